@@ -0,0 +1,113 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis 
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   asyncIO.h
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Asynchronous send/receive on top of floppyIO
+//
+
+#ifndef ASYNCIO_H
+#define ASYNCIO_H
+
+#include <iostream>
+#include <deque>
+#include <future>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "floppyIO.h"
+#include "errorbase.h"
+
+using namespace std;
+
+namespace fpio {
+
+    // Completion callback, called from the I/O thread with the result
+    typedef std::function<void(int)> io_completion;
+
+    //
+    // Asynchronous FloppyIO Class
+    //
+    // Owns a floppyIO instance and a background I/O thread that runs
+    // the queued transfers one after the other. Every *_async call
+    // returns a future with the result the blocking call would have
+    // returned, and optionally calls a completion callback.
+    //
+    // The transfers run in the order they were queued, sends and
+    // receives alike: a receive waiting for its message holds up the
+    // sends queued after it. Queue a receive only once the other end
+    // is expected to send, or cancel() it to get the queue moving.
+    //
+    // Buffers and streams passed to the *_async calls are not copied.
+    // They must stay valid until the transfer completes.
+    //
+    class asyncIO:
+        public errorbase
+    {
+    public:
+
+        // Constructor/Destructor
+        asyncIO(const char * file, int flags = 0, int syncPolicy = SYNC_PER_OPERATION);
+        asyncIO(const char * file, int flags, const disk_layout & layout, int syncPolicy = SYNC_PER_OPERATION);
+        virtual             ~asyncIO();
+
+        // Queue transfers
+        future<int>         send_async(const char * buffer, int size, int streamID = 0, io_completion done = io_completion());
+        future<int>         send_async(istream * stream, unsigned short id = 0, io_completion done = io_completion());
+        future<int>         receive_async(char * buffer, int size, int streamID = 0, io_completion done = io_completion());
+        future<int>         receive_async(ostream * stream, unsigned short id = 0, io_completion done = io_completion());
+
+        // Cancel the queued and in-flight transfers of a stream
+        int                 cancel(unsigned short streamID);
+
+    private:
+
+        // A queued transfer
+        struct job {
+            int             type;
+            char *          buffer;
+            int             size;
+            istream *       in;
+            ostream *       out;
+            unsigned short  streamID;
+            promise<int>    result;
+            io_completion   done;
+        };
+
+        floppyIO *          io;         // Owned by the I/O thread once started
+        thread              worker;
+        mutex               lock;
+        condition_variable  wakeup;
+        deque<job *>        queue;
+        job *               current;    // The transfer in progress
+        bool                stopping;
+
+        void                start();
+        void                run();
+        future<int>         enqueue(job * j);
+        void                complete(job * j, int result);
+
+    };
+
+};
+
+#endif  // ASYNCIO_H
@@ -0,0 +1,55 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   codec.h
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Payload compression codecs
+//
+// zlib is used when <zlib.h> is found at build time (link with -lz).
+// Define FPIO_NO_ZLIB to build without it.
+//
+
+#ifndef CODEC_H
+#define CODEC_H
+
+namespace fpio {
+
+    // Codec IDs, as stored in the extended header
+    const int   CODEC_NONE      = 0;     // Payload stored as-is
+    const int   CODEC_LZ        = 1;     // Built-in fast LZ77 codec
+    const int   CODEC_ZLIB      = 2;     // zlib (deflate), if available
+
+    // Largest uncompressed message we accept
+    const int   SZ_CODEC_MAX_RAW = 16 * 1024 * 1024;
+
+    // Returns TRUE if the codec can be used in this build
+    bool        codec_available( int codec );
+
+    // Encode szSrc bytes into at most szDst bytes.
+    // Returns the encoded size, or -1 if it did not fit.
+    int         codec_encode( int codec, const char * src, int szSrc, char * dst, int szDst );
+
+    // Decode szSrc bytes into at most szDst bytes.
+    // Returns the decoded size, or -1 if the input is corrupt.
+    int         codec_decode( int codec, const char * src, int szSrc, char * dst, int szDst );
+
+};
+
+#endif  // CODEC_H
@@ -0,0 +1,197 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   coroutine.h
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// C++20 coroutine interface on top of floppyIO
+//
+// Needs a C++20 compiler (-std=c++20).
+//
+
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <coroutine>
+#include <exception>
+#include <deque>
+#include <list>
+
+#include "floppyIO.h"
+#include "errorbase.h"
+
+using namespace std;
+
+namespace fpio {
+
+    class executor;
+
+    //
+    // A coroutine returning an int
+    //
+    // Starts suspended. Either hand it to executor::spawn() or co_await
+    // it from another task, which resumes it and gets its result.
+    //
+    class task {
+    public:
+
+        struct promise_type {
+            int                 value;
+            exception_ptr       error;
+            coroutine_handle<>  continuation;
+
+            task                get_return_object();
+            suspend_always      initial_suspend() noexcept { return {}; };
+            auto                final_suspend() noexcept;
+            void                return_value(int v) { this->value = v; };
+            void                unhandled_exception() { this->error = current_exception(); };
+        };
+
+        // Constructor/Destructor
+        task(task && other) noexcept;
+        task &              operator=(task && other) noexcept;
+        ~task();
+
+        // State
+        bool                done() const;
+        int                 result() const;
+
+        // Awaiting a task runs it and returns its result
+        auto                operator co_await() && noexcept;
+
+    private:
+        friend class executor;
+
+        explicit            task(coroutine_handle<promise_type> h) : handle(h) { };
+        task(const task &) = delete;
+        task &              operator=(const task &) = delete;
+
+        coroutine_handle<promise_type>  handle;
+
+    };
+
+    inline task task::promise_type::get_return_object() {
+        return task(coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    // Transfer control back to whoever awaited us, if anybody
+    inline auto task::promise_type::final_suspend() noexcept {
+        struct final_awaiter {
+            bool                await_ready() noexcept { return false; };
+            coroutine_handle<>  await_suspend(coroutine_handle<promise_type> h) noexcept {
+                coroutine_handle<> next = h.promise().continuation;
+                return next ? next : noop_coroutine();
+            };
+            void                await_resume() noexcept { };
+        };
+        return final_awaiter{};
+    }
+
+    inline auto task::operator co_await() && noexcept {
+        struct task_awaiter {
+            coroutine_handle<promise_type>  handle;
+
+            bool                await_ready() noexcept { return !this->handle || this->handle.done(); };
+            coroutine_handle<>  await_suspend(coroutine_handle<> caller) noexcept {
+                this->handle.promise().continuation = caller;
+                return this->handle;
+            };
+            int                 await_resume() {
+                if (this->handle.promise().error) rethrow_exception(this->handle.promise().error);
+                return this->handle.promise().value;
+            };
+        };
+        return task_awaiter{ this->handle };
+    }
+
+    //
+    // A send or receive waiting on the executor
+    //
+    // co_await returns what the blocking call would have returned.
+    // I/O errors are returned as their error code, like asyncIO does.
+    //
+    class io_awaitable {
+    public:
+
+        bool                await_ready();
+        void                await_suspend(coroutine_handle<> h);
+        int                 await_resume() { return this->result; };
+
+    private:
+        friend class executor;
+
+        io_awaitable(executor * owner, bool input, char * buffer, int size, int streamID);
+
+        executor *          owner;
+        bool                input;
+        char *              buffer;
+        int                 size;
+        int                 streamID;
+        int                 result;
+        coroutine_handle<>  handle;
+
+        bool                attempt();
+
+    };
+
+    //
+    // Single-threaded executor for FloppyIO coroutines
+    //
+    // Runs the spawned tasks on the calling thread. Suspended sends and
+    // receives are retried in the order they were issued, and when none
+    // of them can make progress the executor waits for the other end
+    // using the waitStrategy of the floppyIO instance.
+    //
+    // The floppyIO instance is not owned and must not be used by
+    // anybody else while run() is active.
+    //
+    class executor:
+        public errorbase
+    {
+    public:
+
+        // Constructor/Destructor
+        executor(floppyIO * io);
+        virtual             ~executor();
+
+        // Start a task
+        void                spawn(task && t);
+
+        // Run until all tasks are finished (timeout in ms, 0 = forever)
+        int                 run(int timeout = 0);
+
+        // Awaitable I/O
+        io_awaitable        send(char * buffer, int size, int streamID = 0);
+        io_awaitable        receive(char * buffer, int size, int streamID = 0);
+
+    private:
+        friend class io_awaitable;
+
+        floppyIO *              io;
+        list<task>              tasks;
+        deque<coroutine_handle<>> runnable;
+        deque<io_awaitable *>   pending;
+
+        bool                isBlocked(io_awaitable * a);
+
+    };
+
+};
+
+#endif  // COROUTINE_H
@@ -0,0 +1,43 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   crc32c.h
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// CRC32C (Castagnoli) checksums
+//
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+
+namespace fpio {
+
+    //
+    // Extend a CRC32C with more data (start with crc = 0)
+    //
+    // Uses the SSE4.2 crc32 instruction when the CPU has it,
+    // and a table-driven implementation otherwise.
+    //
+    unsigned int    crc32c( unsigned int crc, const void * data, size_t szLen );
+
+};
+
+#endif  // CRC32C_H
@@ -44,6 +44,8 @@ namespace fpio {
     const int   ERR_INPUT       = -5;       // An error occured while processing ipnut
     const int   ERR_ABORTED     = -6;       // Operation aborted
     const int   ERR_INVALID     = -7;       // Invalid usage
+    const int   ERR_AGAIN       = -8;       // The operation would have to wait
+    const int   ERR_CHECKSUM    = -9;       // The message did not match its checksum
 
     // Error levels
     const int   ERL_MINOR       = 1;        // Minor error    : Does not raise exceptions
@@ -33,8 +33,13 @@
 #define FLOPPYIO_H
 
 #include <iostream>
+#include <atomic>
+#include <time.h>
 
 #include "flpdisk.h"
+#include "watcher.h"
+#include "codec.h"
+#include "crc32c.h"
 #include "errorbase.h"
 
 using namespace std;
@@ -43,9 +48,34 @@ namespace fpio {
 
     // Additional open flags
     const int   O_SYNCHRONIZED  = 64;    // Use synchronized I/O
+    const int   O_CHECKSUM      = 256;   // Add a CRC32C to the messages we send (needs O_EXTENDED)
+
+    // How many times a message with a bad checksum is read again
+    const int   CHECKSUM_RETRIES = 3;
 
     // Default synchronization timeout
-    const int   SYNC_TIMEOUT    = 4;     // 4 Seconds
+    const int   SYNC_TIMEOUT    = 4000;  // 4 Seconds (in milliseconds)
+
+    //
+    // Strategy for waiting on the other end
+    //
+    // The control byte is first polled spinCount times back-to-back.
+    // Then we sleep between polls, starting at sleepMinUs and doubling
+    // up to sleepMaxUs. On file-backed images with change notifications
+    // (not with O_MMAP) the sleeps are spent blocked on the watcher, and
+    // end early when the image changes.
+    //
+    struct wait_strategy {
+        unsigned int spinCount;             // Polls before we start sleeping
+        unsigned int sleepMinUs;            // The first sleep
+        unsigned int sleepMaxUs;            // The longest sleep
+    };
+
+    // Predefined wait strategies
+    const wait_strategy WAIT_FIXED       = { 0,     1000, 1000 };   // Poll every millisecond (the original behaviour)
+    const wait_strategy WAIT_ADAPTIVE    = { 50,    20,   1000 };   // Spin shortly, then back off up to a millisecond
+    const wait_strategy WAIT_LOW_LATENCY = { 10000, 5,    200  };   // Burn CPU for the lowest wake-up latency
+    const wait_strategy WAIT_LOW_CPU     = { 0,     500,  20000 };  // Back off up to 20ms when idle
 
     //
     // FloppyIO Class
@@ -56,7 +86,8 @@ namespace fpio {
     public:
 
         // Constructor/Destructor
-        floppyIO(const char * file, int flags = 0) ;
+        floppyIO(const char * file, int flags = 0, int syncPolicy = SYNC_PER_OPERATION);
+        floppyIO(const char * file, int flags, const disk_layout & layout, int syncPolicy = SYNC_PER_OPERATION);
         virtual             ~floppyIO();
 
         // Send/Receive data from stream
@@ -69,18 +100,102 @@ namespace fpio {
         int                 receive(string buffer);
         int                 receive(char * buffer, int size, int streamID = 0);
 
-        // Synchronization
+        // Scatter/gather Send/Receive (at most MAX_IOV pieces)
+        int                 send(const struct iovec * iov, int count, int streamID = 0);
+        int                 receive(const struct iovec * iov, int count, int streamID = 0);
+
+        // Zero-copy send: fill the reserved space, then commit it
+        char *              reserve(int size, int streamID = 0);
+        int                 commit(int size, int streamID = 0);
+
+        // Zero-copy receive: look at the message in place, then release it
+        int                 receive_view(const char ** data, int streamID = 0);
+        int                 release(int streamID = 0);
+
+        // Payload compression for the messages we send on a stream
+        int                 setCodec(int codec, int streamID = 0);
+
+        // Move the split between the directions (LO_SUPERBLOCK layouts)
+        int                 rebalance(int timeout = 0, int pctIn = -1);
+
+        // Non-blocking Send/Receive (ERR_AGAIN if they would wait)
+        int                 poll_send(char * buffer, int size, int streamID = 0);
+        int                 poll_receive(char * buffer, int size, int streamID = 0);
+
+        // Synchronization (timeouts in milliseconds, 0 = forever)
         int                 waitForSyncIn(unsigned short streamID, int timeout = 0);
         int                 waitForSyncOut(unsigned short streamID, int timeout = 0);
+        int                 drain(int timeout = 0, int streamID = -1);
+        void                waitForChange(unsigned int iteration, unsigned long long tExpired);
+
+        // Cancellation (abort is thread-safe)
+        void                abort(unsigned short streamID, bool state = true);
+        int                 sendAbort(unsigned short streamID);
 
         // Variables
-        int                 syncTimeout;
+        int                 syncTimeout;        // Milliseconds
         bool                useSynchronization;
+        bool                useChecksum;
+        wait_strategy       waitStrategy;
+
+    protected:
+
+        // Capability negotiation
+        virtual int         localCaps();
+        virtual void        applyCaps( int caps );
+        virtual void        layoutChanged();
 
     private:
 
-        ctrlbyte            inCB, outCB;
-        extended_header     inHDR, outHDR;
+        // Per-stream control state
+        ctrlbyte            inCB[MAX_STREAMS], outCB[MAX_STREAMS];
+        extended_header     inHDR[MAX_STREAMS], outHDR[MAX_STREAMS];
+
+        // Abort requests per stream
+        std::atomic<bool>   abortPending[MAX_STREAMS];
+
+        // Per slot group ring positions
+        unsigned int        inSlot[MAX_STREAMS];    // The next slot to read from
+        unsigned int        outSlot[MAX_STREAMS];   // The next slot to write to
+
+        unsigned int        streamGroup(unsigned short streamID);
+        unsigned int        streamSlot(bool input, unsigned short streamID, int offset = 0);
+        void                advanceSlot(bool input, unsigned short streamID);
+
+        // Payload bytes per direction since the last rebalance
+        unsigned long long  trafficIn, trafficOut;
+
+        watcher *           watch;          // Change notifications on file-backed images
+        char *              staging;        // Reserved space when the image is not mapped
+        char *              inStaging;      // Viewed message when the image is not mapped
+        bool                viewPending[MAX_STREAMS];
+
+        // Payload compression
+        int                 codecOut[MAX_STREAMS];
+        char *              encBuffer;      // One buffer of encoded payload
+        char *              rawBuffer;      // Decoded or gathered messages
+        int                 szRawBuffer;
+
+        char *              codecBuffer();
+        char *              rawSpace(int size);
+        int                 postCoded(const char * data, int size, int szRaw, int codec, int streamID);
+        bool                needsLoad(int streamID);
+        int                 loadIn(unsigned int slot, int streamID, const char ** data);
+        unsigned int        checksum(const extended_header * hdr, const char * payload, int size);
+        void                checksumOut(int streamID, const struct iovec * iov, int count);
+        int                 sendCoded(istream * stream, unsigned short id);
+        int                 drainStream(unsigned short id);
+
+        void                initIO(const char * file, int flags);
+        int                 post(char * buffer, int size, int streamID);
+        int                 postv(const struct iovec * iov, int count, int streamID);
+        void                prepareOut(int size, int streamID);
+        int                 waitForSlot(int streamID);
+        int                 waitForRead(int streamID);
+        int                 consume(char * buffer, int size, int streamID);
+        void                clearInput(int streamID);
+        int                 waitForControl(bool input, unsigned int slot, int streamID, bool matchID, bool present, int timeout, ctrlbyte * cb);
+        int                 pollControl(bool input, unsigned int slot, int streamID, bool matchID, bool present, int timeout, ctrlbyte * cb);
 
     };
 
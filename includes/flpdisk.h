@@ -26,7 +26,13 @@
 #ifndef FLPDISK_H
 #define FLPDISK_H
 
+#include <sys/uio.h>
+#include <mutex>
+#include <vector>
+
 #include "errorbase.h"
+#include "stats.h"
+#include "trace.h"
 
 #define FPIO_VERSION  0,3
 
@@ -35,6 +41,15 @@ namespace fpio {
     // The size of the floppy disk (1.44Mb)
     const int   SZ_FLOPPY = 1474560;
 
+    // The size of an extra-density floppy disk (2.88Mb)
+    const int   SZ_FLOPPY_ED = 2949120;
+
+    // The largest image we can address
+    const int   SZ_IMAGE_MAX = 1024 * 1024 * 1024;
+
+    // The size of a disk sector
+    const int   SZ_SECTOR = 512;
+
     // Open flags
     const int   O_DEVICE        = 1;     // Notifies FloppyIO that we are about to open a block device
     const int   O_CREATE        = 2;     // Create file if it doesn't exist
@@ -42,6 +57,69 @@ namespace fpio {
     const int   O_EXCEPTIONS    = 8;     // Throw exceptions on errors
     const int   O_CLIENT        = 16;    // Swap in/out buffers
     const int   O_EXTENDED      = 32;    // Use extended protocol
+    const int   O_MMAP          = 128;   // Memory-map the image instead of using read/write
+    const int   O_DELTA         = 512;   // Only write the sectors of a message that changed (LO_SUPERBLOCK layouts)
+    const int   O_DIRECTIO      = 1024;  // Bypass the page cache (O_DIRECT), on LO_ALIGNED layouts only
+    const int   O_STATS         = 2048;  // Keep I/O counters and histograms (see getStats)
+    const int   O_TRACE         = 4096;  // Record message lifecycle events (see dumpTrace)
+    const int   O_AUTOSIZE      = 8192;  // Fit the layout to the size of an existing image or device
+
+    //
+    // Synchronization policies
+    //
+    // Chosen when the disk is opened, they define how much work is done
+    // to make the changes of each end visible to the other one.
+    //
+    // SYNC_PER_OPERATION   Every read is preceded and every write followed by a
+    //                      full sync (fsync, FDFLUSH, BLKFLSBUF). Each field is on
+    //                      the media when the call returns and every read sees the
+    //                      media. Slowest, but safe with any hypervisor caching.
+    //
+    // SYNC_PER_COMMIT      Writes are durable when they return (O_SYNC or msync of
+    //                      the written range) and a message commit places a barrier
+    //                      between the payload and the control byte. Caches are only
+    //                      invalidated before reading a control byte, so a payload is
+    //                      fresh only if read after observing its control byte.
+    //
+    // SYNC_READ_INVALIDATE Nothing is flushed; writes reach the other end whenever
+    //                      the kernel writes them back. Control byte reads still drop
+    //                      caches. Fine when the other end reads through the same
+    //                      page cache, e.g. a hypervisor on the same host.
+    //
+    // SYNC_NONE            No syncs at all. Only for tmpfs images or both ends in
+    //                      the same OS, where the page cache is always coherent.
+    //
+    const int   SYNC_PER_OPERATION   = 0;
+    const int   SYNC_PER_COMMIT      = 1;
+    const int   SYNC_READ_INVALIDATE = 2;
+    const int   SYNC_NONE            = 3;
+
+    // Layout versions
+    const int   LAYOUT_CLASSIC  = 1;     // One buffer and one control byte per direction
+    const int   LAYOUT_RING     = 2;     // Each direction is split in slots with their own control byte
+
+    // The maximum number of slots per direction
+    const int   MAX_SLOTS       = 64;
+
+    // The number of stream IDs the control byte can address
+    const int   MAX_STREAMS     = 8;
+
+    // Options for make_layout()
+    const int   LO_MULTIPLEX    = 1;     // Give every stream ID its own group of slots
+    const int   LO_ALIGNED      = 2;     // Start every slot on a block, with the header in the same sector
+    const int   LO_SUPERBLOCK   = 4;     // Describe the layout in a superblock in the first sector
+
+    // How much of the image goes to the input of the host (percent)
+    const int   SPLIT_EVEN      = 50;
+    const int   SPLIT_MIN       = 5;
+    const int   SPLIT_MAX       = 95;
+
+    // Where the buffer starts in the first sector of an aligned slot
+    const int   OFS_ALIGNED_BUFFER = 16;
+
+    // What aligned layouts round slots to. Direct I/O on 4K devices
+    // and filesystems writes whole blocks of this size.
+    const int   SZ_ALIGNED_BLOCK = 4096;
 
     //
     // FloppyIO disk file layout information
@@ -49,6 +127,23 @@ namespace fpio {
     // This structure provides the location and sizes
     // of all the data location inside the file.
     //
+    // On layouts with more than one slot, the offsets and sizes
+    // describe the first slot of each direction. Slot N is found
+    // N strides further.
+    //
+    // Multiplexed layouts split the slots into numStreams equal
+    // groups, one for each stream ID, so that the streams do not
+    // block each other.
+    //
+    // Aligned layouts start every slot on a SZ_ALIGNED_BLOCK boundary,
+    // with the control byte at +0 and the buffer (header first) at
+    // OFS_ALIGNED_BUFFER, so a small message fits in one sector and
+    // the two ends never write to the same block. They are the ones
+    // O_DIRECTIO can use.
+    //
+    // szImage is the size of the image the layout was built for.
+    // The image is stretched to it when opened.
+    //
     struct disk_layout {
     
         unsigned int ofsControlIn;
@@ -59,6 +154,14 @@ namespace fpio {
         unsigned int szControlByte;
         unsigned int szBufferIn;
         unsigned int szBufferOut;
+
+        unsigned int version;
+        unsigned int numSlots;
+        unsigned int szStrideIn;
+        unsigned int szStrideOut;
+        unsigned int numStreams;
+        unsigned int options;           // LO_* options the layout was built with
+        unsigned int szImage;           // The size of the image
         
     };
 
@@ -71,8 +174,77 @@ namespace fpio {
         
         1,              // szControlByte   Control byte is a byte (Duh!)
         SZ_FLOPPY/2-1,  // szBufferIn      Half of the block goes to input
-        SZ_FLOPPY/2-1   // szBufferOut     The other half goes to output
+        SZ_FLOPPY/2-2,  // szBufferOut     The other half goes to output (up to the end of the image)
+
+        LAYOUT_CLASSIC, // version
+        1,              // numSlots        A single buffer per direction
+        0,              // szStrideIn
+        0,              // szStrideOut
+        1,              // numStreams      All streams share the buffer
+        0,              // options
+        SZ_FLOPPY       // szImage
     };
+
+    //
+    // Capabilities, as offered by each end in the superblock
+    //
+    // The ends use what both of them offer. Features that change
+    // the wire format (extended headers, acknowledgements) are only
+    // offered when enabled; the others when this end can read them.
+    //
+    const int   CAP_EXTENDED     = 1;           // Extended headers (O_EXTENDED)
+    const int   CAP_SYNCHRONIZED = 2;           // Acknowledged transfers (O_SYNCHRONIZED)
+    const int   CAP_RING         = 4;           // Layouts with more than one slot
+    const int   CAP_INLINE       = 8;           // Inline frames on aligned layouts
+    const int   CAP_CHECKSUM     = 16;          // CRC32C-checked messages
+    const int   CAP_CODEC_LZ     = 32;          // Built-in LZ compression
+    const int   CAP_CODEC_ZLIB   = 64;          // zlib compression
+    const int   CAP_REBALANCE    = 128;         // Moving the split at run time (floppyIO::rebalance)
+    const int   CAP_PUBLISHED    = 0x40000000;  // Set when an end has written its capabilities
+
+    // Superblock identification
+    const unsigned int SB_MAGIC   = 0x4F495046;  // "FPIO"
+    const unsigned int SB_VERSION = 1;
+
+    //
+    // The superblock of layouts built with LO_SUPERBLOCK
+    //
+    // It lives at the start of the image, and the slots start on the
+    // next sector. The host writes it when it opens the image, and
+    // clients take the layout from it instead of their own. The
+    // checksum covers everything up to itself. The capabilities are
+    // written later, each by its own end (see flpdisk::negotiate).
+    //
+    // To change the layout later, the host writes the new one to
+    // 'next' and bumps 'proposed'. The client switches to it and
+    // copies 'proposed' to 'accepted'.
+    //
+    // Every reset of the image bumps 'resets', so that an end keeping
+    // a copy of the image (O_DELTA) knows to read it again.
+    //
+    struct superblock {
+        unsigned int    magic;          // SB_MAGIC
+        unsigned int    version;        // SB_VERSION
+        disk_layout     layout;         // The layout, as seen from the host
+        unsigned int    checksum;       // CRC32C of the fields above
+        unsigned int    capsHost;       // CAP_* offered by the host
+        unsigned int    capsClient;     // CAP_* offered by the client
+        unsigned int    proposed;       // The generation of 'next', written by the host
+        unsigned int    accepted;       // The last generation the client switched to
+        unsigned int    resets;         // How many times the image was reset
+        disk_layout     next;           // The layout the host switched to
+    };
+
+    // Build the default layout for an image of the given size, giving
+    // pctIn percent of it to the input of the host
+    disk_layout make_classic_layout( unsigned int szImage = SZ_FLOPPY, unsigned int pctIn = SPLIT_EVEN );
+
+    // Build a ring layout with the given number of slots per direction
+    // (or per stream and direction with LO_MULTIPLEX)
+    disk_layout make_layout( unsigned int numSlots, int options = 0, unsigned int szImage = SZ_FLOPPY, unsigned int pctIn = SPLIT_EVEN );
+
+    // The percentage of its space a layout gives to the input of the host
+    unsigned int layout_split( const disk_layout & layout );
     
     //
     // Structure of the synchronization control byte.
@@ -109,14 +281,55 @@ namespace fpio {
     union extended_header {
         struct {
             unsigned int   szLength;            // The pending buffer size
-            unsigned char  reserved[12];        // Reserved bytes for future use
+            unsigned char  codec;               // How the payload is encoded (CODEC_*)
+            unsigned char  hflags;              // Header flags (HF_*)
+            unsigned char  reserved[2];         // Reserved bytes for future use
+            unsigned int   szRaw;               // The payload size before encoding
+            unsigned int   crc;                 // CRC32C of header and payload, if HF_CHECKSUM
         };
         unsigned char      value[16];           // RAW Representation for simplified I/O
     };
 
+    // Extended header flags
+    const int HF_CHECKSUM = 1;          // The crc field is valid
+
     // The size of the extended header
     const int SZ_EXTENDED_HEADER = sizeof( extended_header );
 
+    //
+    // Lead bytes of a slot on aligned layouts
+    //
+    // The control byte is followed by OFS_ALIGNED_BUFFER-1 bytes that
+    // belong to the writer of the slot. A message that fits in the
+    // first sector of the slot is an inline frame: the lead says so and
+    // holds the payload size, and the reader gets the whole message
+    // with the read that fetches the control byte.
+    //
+    union frame_lead {
+        struct {
+            unsigned char  cb;                  // The control byte
+            unsigned char  fflags;              // Frame flags (FF_*)
+            unsigned short szInline;            // The payload size of an inline frame
+            unsigned char  reserved[12];        // Reserved bytes for future use
+        };
+        unsigned char      value[OFS_ALIGNED_BUFFER];
+    };
+
+    // Frame flags
+    const int FF_INLINE = 1;            // The whole message is in the first sector
+
+    // Maximum span fetched in a single read by flpdisk::fetch_in
+    const int SZ_FETCH_SPAN = 512;
+
+    // Maximum number of pieces in a scatter/gather message
+    const int MAX_IOV = 64;
+
+    // An aligned buffer for direct I/O
+    struct bounce_buffer {
+        char *          data;
+        unsigned int    size;
+    };
+
     //
     // Floppy Disk I/O Class
     //
@@ -124,46 +337,147 @@ namespace fpio {
     // file or block device. It provides a memory-mapped structure with 
     // real-time communication with the other end.
     //
+    // Different slots can be used from different threads at the same
+    // time, as long as each slot is used by one thread at a time, and
+    // the layout does not change meanwhile. The error state is shared.
+    // O_DELTA keeps one copy of the image for everybody, so it is only
+    // for a single thread.
+    //
     class flpdisk: 
         public errorbase 
     {
     public:
 
         // Constructor/Destructor
-        flpdisk(const char * file, int flags = 0);
+        flpdisk(const char * file, int flags = 0, int syncPolicy = SYNC_PER_OPERATION);
+        flpdisk(const char * file, int flags, const disk_layout & layout, int syncPolicy = SYNC_PER_OPERATION);
         virtual             ~flpdisk();
 
         // Get/Set control bytes
-        int                 get_in_cb( ctrlbyte * cb);
-        int                 set_in_cb( ctrlbyte * cb);
-        int                 get_out_cb( ctrlbyte * cb);
-        int                 set_out_cb( ctrlbyte * cb);
+        int                 get_in_cb( ctrlbyte * cb, unsigned int slot = 0 );
+        int                 set_in_cb( ctrlbyte * cb, unsigned int slot = 0 );
+        int                 get_out_cb( ctrlbyte * cb, unsigned int slot = 0 );
+        int                 set_out_cb( ctrlbyte * cb, unsigned int slot = 0 );
 
         // Get/Set extended headers
-        int                 get_in_xhdr( extended_header * hdr );
-        int                 set_in_xhdr( extended_header * hdr );
-        int                 get_out_xhdr( extended_header * hdr );
-        int                 set_out_xhdr( extended_header * hdr );
+        int                 get_in_xhdr( extended_header * hdr, unsigned int slot = 0 );
+        int                 set_in_xhdr( extended_header * hdr, unsigned int slot = 0 );
+        int                 get_out_xhdr( extended_header * hdr, unsigned int slot = 0 );
+        int                 set_out_xhdr( extended_header * hdr, unsigned int slot = 0 );
 
         // Read/Write buffers
-        int                 read_in( char * buffer, int szLen );
-        int                 read_out( char * buffer, int szLen );
-        int                 write_in( char * buffer, int szLen );
-        int                 write_out( char * buffer, int szLen );
+        int                 read_in( char * buffer, int szLen, unsigned int slot = 0 );
+        int                 read_out( char * buffer, int szLen, unsigned int slot = 0 );
+        int                 write_in( char * buffer, int szLen, unsigned int slot = 0 );
+        int                 write_out( char * buffer, int szLen, unsigned int slot = 0 );
+        int                 peek_in( const char ** view, int szLen, unsigned int slot = 0 );
+        int                 read_inv( const struct iovec * iov, int iovcnt, int szLen, unsigned int slot = 0 );
+
+        // Message commit/fetch
+        int                 commit_out( const char * buffer, int szLen, ctrlbyte * cb, extended_header * hdr, unsigned int slot = 0 );
+        int                 commit_outv( const struct iovec * iov, int iovcnt, ctrlbyte * cb, extended_header * hdr, unsigned int slot = 0 );
+        int                 fetch_in( ctrlbyte * cb, extended_header * hdr, unsigned int slot = 0 );
+
+        // Direct views on the memory-mapped image (NULL if not mapped)
+        ctrlbyte *          in_cb_view( unsigned int slot = 0 );
+        ctrlbyte *          out_cb_view( unsigned int slot = 0 );
+        extended_header *   in_xhdr_view( unsigned int slot = 0 );
+        extended_header *   out_xhdr_view( unsigned int slot = 0 );
+        char *              in_buffer_view( unsigned int slot = 0 );
+        char *              out_buffer_view( unsigned int slot = 0 );
 
         // Utility functions
         int                 reset();
         int                 sync();
+        int                 flush( unsigned int ofs, unsigned int szLen );
+        int                 invalidate( unsigned int ofs, unsigned int szLen );
         virtual bool        ready();
+        unsigned int        imageSize();
+
+        // Agree with the other end on the capabilities to use (LO_SUPERBLOCK layouts)
+        int                 negotiate( int timeout = 0 );
+
+        // Instrumentation (NULL if not enabled)
+        void                enableStats( bool state = true );
+        io_stats *          getStats();
+        void                enableTrace( bool state = true, unsigned int capacity = SZ_TRACE_RING );
+        trace_ring *        getTrace();
+        int                 dumpTrace( const char * file );
 
         // Layout
         disk_layout         layout;
         bool                useExtended; // Use extended version of the protocol
+        int                 syncPolicy;  // The synchronization policy (set at open time)
+        int                 caps;        // The negotiated capabilities (CAP_*), or -1
+
+    protected:
+
+        io_stats *          stats;       // Counters, if enabled (O_STATS)
+        io_stats *          statsStore;  // The counters, kept once allocated
+        trace_ring *        tracer;      // Lifecycle events, if enabled (O_TRACE)
+
+        void                traceEvent( int type, int streamID, int slot = -1, int size = -1 );
+
+        // Capability negotiation
+        virtual int         localCaps();
+        virtual void        applyCaps( int caps );
+        int                 publishCaps();
+        int                 adoptCaps( unsigned int peer );
+        int                 settleCaps();
+
+        // Layout changes (LO_SUPERBLOCK layouts)
+        int                 proposeLayout( const disk_layout & next, int timeout );
+        int                 acceptLayout( int timeout );
+        virtual void        layoutChanged();
+        bool                isClient;    // Opened with O_CLIENT
 
     private:
 
         int                 fd;          // File descriptor
         bool                useDevice;   // Use device I/O (ioctl when needed) instead of file I/O
+        char *              map;         // The memory-mapped image if O_MMAP was used, or NULL
+        char *              shadow;      // What we last wrote or read, if O_DELTA was used
+        unsigned char *     dirty;       // One flag per sector, used by deltaWritev
+        unsigned int        resets;      // The reset count the shadow was read at (LO_SUPERBLOCK)
+        bool                useDirect;   // O_DIRECT I/O through bounce buffers
+        unsigned int        szAlign;     // The alignment O_DIRECT needs (sector size)
+        mutex               bounceLock;  // Guards bouncePool
+        vector<bounce_buffer> bouncePool; // Free aligned buffers for O_DIRECT I/O
+        char *              inFrames;    // The first sector of every input slot, as fetch_in read it (aligned layouts)
+        bool                inFrameValid[MAX_SLOTS]; // The slot holds an inline frame fetch_in already read
+        bool                useInline;   // Send small messages as inline frames on aligned layouts
+        bool                capsPublished; // Our capabilities are in the superblock
+        unsigned int        generation;  // The layout generation we are using
+
+        // Open the image
+        void                init( const char * file, int flags, const disk_layout & layout, int syncPolicy );
+        int                 writeSuperblock();
+        int                 loadShadow();
+        void                setLayout( const disk_layout & hostView );
+        int                 waitSuperblock( unsigned int ofs, unsigned int value, int timeout, unsigned int * result );
+
+        // Raw I/O on a region of the image
+        int                 syncAt( int point, unsigned int ofs, unsigned int szLen );
+        int                 ioRead( unsigned int ofs, void * buffer, unsigned int szLen, int point, const char * what );
+        int                 ioReadv( unsigned int ofs, const struct iovec * iov, int iovcnt, int point, const char * what );
+        int                 ioWrite( unsigned int ofs, const void * buffer, unsigned int szLen, const char * what );
+        int                 ioWritev( unsigned int ofs, const struct iovec * iov, int iovcnt, const char * what );
+        int                 deltaWritev( unsigned int ofs, const struct iovec * iov, int iovcnt, const char * what );
+        int                 rawRead( unsigned int ofs, void * buffer, unsigned int szLen );
+        int                 rawWrite( unsigned int ofs, const void * buffer, unsigned int szLen );
+        int                 directReadv( unsigned int ofs, const struct iovec * iov, int iovcnt );
+        int                 directWritev( unsigned int ofs, const struct iovec * iov, int iovcnt );
+        char *              acquireBounce( unsigned int szLen, unsigned int * szBuffer );
+        void                releaseBounce( char * buffer, unsigned int szBuffer );
+        int                 payloadRegion( bool input, unsigned int slot, unsigned int * ofs, int * szLen );
+        const char *        inlinePayload( unsigned int slot, int * szLen );
+        unsigned int        ofsControl( bool input, unsigned int slot );
+        unsigned int        ofsBuffer( bool input, unsigned int slot );
+        int                 checkSlot( unsigned int slot );
+        int                 commitOut( const struct iovec * iov, int iovcnt, int szLen, ctrlbyte * cb, extended_header * hdr, unsigned int slot );
+        int                 writeMessage( const struct iovec * iov, int iovcnt, int szLen, ctrlbyte * cb, extended_header * hdr, unsigned int slot );
+        int                 fetchIn( ctrlbyte * cb, extended_header * hdr, unsigned int slot );
+        void                countCall( int type );
             
     };
     
@@ -0,0 +1,117 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   stats.h
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Instrumentation counters and histograms
+//
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <string>
+
+namespace fpio {
+
+    // The number of stream IDs (same as MAX_STREAMS in flpdisk.h)
+    const int   NUM_STAT_STREAMS = 8;
+
+    // The number of buckets in a histogram
+    const int   NUM_HIST_BUCKETS = 32;
+
+    //
+    // A counter that can be read while another thread updates it
+    //
+    // Updates and reads are relaxed atomics. Every counter is exact on
+    // its own, but counters read while I/O goes on may be a few events
+    // apart from each other.
+    //
+    struct stat_counter {
+        std::atomic<unsigned long long> value;
+
+        void                operator++( int );
+        void                operator+=( unsigned long long n );
+        void                raise( unsigned long long n );
+        void                reset();
+                            operator unsigned long long() const;
+    };
+
+    //
+    // Histogram with power-of-two buckets
+    //
+    // Bucket 0 counts zeroes and bucket N counts the values in
+    // [2^(N-1), 2^N). The last bucket also takes everything larger.
+    //
+    struct histogram {
+        stat_counter        count;
+        stat_counter        sum;
+        stat_counter        max;
+        stat_counter        buckets[NUM_HIST_BUCKETS];
+
+        void                add( unsigned long long value );
+        void                clear();
+        unsigned long long  percentile( double p ) const;
+    };
+
+    // System calls we count
+    const int   SC_PREAD        = 0;
+    const int   SC_PWRITE       = 1;
+    const int   SC_PREADV       = 2;
+    const int   SC_PWRITEV      = 3;
+    const int   SC_FSYNC        = 4;
+    const int   SC_FDATASYNC    = 5;
+    const int   SC_MSYNC        = 6;
+    const int   SC_IOCTL        = 7;
+    const int   NUM_SYSCALLS    = 8;
+
+    //
+    // Counters of a flpdisk/floppyIO instance
+    //
+    // Only kept when stats are enabled (O_STATS or enableStats()),
+    // otherwise the instance does not even allocate them. They can be
+    // read and dumped from any thread (see stat_counter), also after
+    // enableStats(false).
+    //
+    struct io_stats {
+        stat_counter        syscalls[NUM_SYSCALLS];         // By SC_* type
+        stat_counter        syncs;                          // sync(), flush() and invalidate() calls
+        stat_counter        bytesIn;                        // Bytes read from the image
+        stat_counter        bytesOut;                       // Bytes written to the image
+        stat_counter        bytesFlushed;                   // Bytes of a mapped image flushed by msync
+        stat_counter        messagesIn[NUM_STAT_STREAMS];   // Messages received per stream ID
+        stat_counter        messagesOut[NUM_STAT_STREAMS];  // Messages committed per stream ID
+        stat_counter        polls;                          // Control byte polls while waiting
+        stat_counter        timeouts;                       // Waits that timed out
+        histogram           waitTime;                       // Microseconds per wait for the other end
+        histogram           commitTime;                     // Microseconds per message commit
+
+        void                clear();
+        std::string         text() const;
+        std::string         json() const;
+    };
+
+    // Microseconds on the monotonic clock, the time base of the
+    // histograms, the trace events and the I/O timeouts
+    unsigned long long  monotonic_time();
+
+};
+
+#endif  // STATS_H
@@ -0,0 +1,106 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis 
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   stripedIO.h
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// One logical channel striped over several floppyIO images
+//
+
+#ifndef STRIPEDIO_H
+#define STRIPEDIO_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "floppyIO.h"
+#include "errorbase.h"
+
+using namespace std;
+
+namespace fpio {
+
+    // The most images one channel can be striped over
+    const int   MAX_STRIPES     = 8;
+
+    // Chunks queued per stripe between the stream and its I/O thread
+    const int   STRIPE_QUEUE_DEPTH = 4;
+
+    //
+    // The header in front of every chunk of a striped transfer
+    //
+    // Chunk N of a transfer goes to stripe N % numStripes, so every
+    // stripe carries its chunks in order and the sequence number only
+    // confirms that the two ends agree. After the last chunk every
+    // stripe gets an empty chunk with SF_END, so that the receiving
+    // threads know when to stop.
+    //
+    struct stripe_header {
+        unsigned int    seq;            // The chunk number in the transfer
+        unsigned int    flags;          // Chunk flags (SF_*)
+    };
+
+    // Chunk flags
+    const int SF_END    = 1;            // No more chunks on this stripe
+    const int SF_ABORT  = 2;            // The sender gave up, the data is incomplete
+
+    //
+    // Striped FloppyIO Class
+    //
+    // Owns a floppyIO instance per image, all opened with the same
+    // flags and layout. Stream transfers are cut in chunks of one
+    // buffer each, which are sent and received on all the images at
+    // the same time, one thread per image. O_EXTENDED and
+    // O_SYNCHRONIZED are always used.
+    //
+    // Both ends must list the images in the same order.
+    //
+    class stripedIO:
+        public errorbase
+    {
+    public:
+
+        // Constructor/Destructor
+        stripedIO(const vector<string> & files, int flags = 0, int syncPolicy = SYNC_PER_OPERATION);
+        stripedIO(const vector<string> & files, int flags, const disk_layout & layout, int syncPolicy = SYNC_PER_OPERATION);
+        virtual             ~stripedIO();
+
+        // Send/Receive data from stream
+        int                 send(istream * stream, unsigned short id = 0);
+        int                 receive(ostream * stream, unsigned short id = 0);
+
+        // The images, e.g. to tune their timeouts and wait strategies
+        int                 numStripes();
+        floppyIO *          stripe(int index);
+
+        virtual bool        ready();
+
+    private:
+
+        vector<floppyIO *>  stripes;
+
+        void                open(const vector<string> & files, int flags, const disk_layout * layout, int syncPolicy);
+        int                 chunkSize(int index, bool input);
+
+    };
+
+};
+
+#endif  // STRIPEDIO_H
@@ -0,0 +1,116 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   trace.h
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Message lifecycle tracing
+//
+// Events go to a fixed-size ring that any thread can append to
+// without locking. The oldest events are overwritten when it is
+// full. The ring can be dumped in the Chrome trace event format,
+// which chrome://tracing and Perfetto open directly.
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <string>
+
+namespace fpio {
+
+    // Event types
+    const int   TE_SEND         = 0;     // Span: a send() call
+    const int   TE_RECEIVE      = 1;     // Span: a receive() call
+    const int   TE_WAIT_IN      = 2;     // Span: waiting for input
+    const int   TE_WAIT_OUT     = 3;     // Span: waiting for an output slot to be read
+    const int   TE_RESERVE      = 4;     // Output space reserved for a zero-copy send
+    const int   TE_PAYLOAD      = 5;     // Header and payload written
+    const int   TE_PUBLISH      = 6;     // Control byte published
+    const int   TE_ACK          = 7;     // The other end released an output slot
+    const int   TE_FETCH        = 8;     // Control byte and header of a message fetched
+    const int   TE_CONSUMED     = 9;     // Input slot released
+    const int   NUM_TRACE_TYPES = 10;
+
+    // Event phases (as in the Chrome trace format)
+    const char  TP_BEGIN        = 'B';
+    const char  TP_END          = 'E';
+    const char  TP_INSTANT      = 'i';
+
+    // Default ring size, in events
+    const unsigned int SZ_TRACE_RING = 65536;
+
+    //
+    // One trace event
+    //
+    // seq is the position of the event in the ring plus one. It is
+    // written last, so a reader can tell a complete event apart from
+    // one being written or overwritten.
+    //
+    struct trace_event {
+        std::atomic<unsigned long long> seq;
+        unsigned long long  ts;             // Microseconds on the monotonic clock
+        unsigned char       type;           // TE_*
+        char                phase;          // TP_*
+        unsigned char       streamID;
+        int                 slot;           // -1 if not known
+        int                 size;           // Bytes, or -1 if not known
+    };
+
+    //
+    // Lock-free ring of trace events
+    //
+    class trace_ring {
+    public:
+
+        trace_ring( unsigned int capacity = SZ_TRACE_RING );
+        ~trace_ring();
+
+        void                event( int type, char phase, int streamID, int slot = -1, int size = -1 );
+        std::string         json();
+
+    private:
+
+        trace_event *       ring;
+        unsigned int        capacity;
+        std::atomic<unsigned long long> head;
+
+    };
+
+    //
+    // Begin/end pair around a scope, if tracing is enabled
+    //
+    class trace_span {
+    public:
+
+        trace_span( trace_ring * ring, int type, int streamID );
+        ~trace_span();
+
+    private:
+
+        trace_ring *        ring;
+        int                 type;
+        int                 streamID;
+
+    };
+
+};
+
+#endif  // TRACE_H
@@ -0,0 +1,67 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis 
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   watcher.h
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// File change notification
+//
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+namespace fpio {
+
+    // Longest time to block on a watch before re-checking anyway.
+    // Writes through a shared mapping (e.g. an O_MMAP peer) do not
+    // generate notifications, so we never trust the watch alone.
+    const int   WATCH_SLICE_MS  = 10;
+
+    //
+    // File watcher
+    //
+    // Blocks until a regular file is modified by someone else
+    // (for example the hypervisor writing to the floppy image).
+    // Uses inotify where available. On block devices, or when
+    // inotify is not available, the watcher is not active and
+    // the caller should fall back to polling.
+    //
+    class watcher {
+    public:
+
+        // Constructor/Destructor
+        watcher(const char * file);
+        virtual             ~watcher();
+
+        // Returns TRUE if change notifications are available
+        bool                active();
+
+        // Wait for a change. Returns 1 on change, 0 on timeout
+        int                 wait(unsigned long long timeoutUs);
+
+    private:
+
+        int                 fd;         // The notification descriptor
+        int                 wd;         // The watch descriptor
+
+    };
+
+};
+
+#endif  // WATCHER_H
@@ -0,0 +1,258 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis 
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   asyncIO.cpp
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Asynchronous send/receive on top of floppyIO
+//
+
+#include "../includes/asyncIO.h"
+
+using namespace std;
+using namespace fpio;
+
+// Job types
+static const int JOB_SEND           = 0;
+static const int JOB_SEND_STREAM    = 1;
+static const int JOB_RECEIVE        = 2;
+static const int JOB_RECEIVE_STREAM = 3;
+
+//
+// Constructor
+//
+asyncIO::asyncIO(const char * file, int flags, int syncPolicy) {
+    this->io = new floppyIO(file, flags, syncPolicy);
+    this->start();
+}
+
+//
+// Constructor with explicit disk layout
+//
+asyncIO::asyncIO(const char * file, int flags, const disk_layout & layout, int syncPolicy) {
+    this->io = new floppyIO(file, flags, layout, syncPolicy);
+    this->start();
+}
+
+//
+// Start the I/O thread
+//
+void asyncIO::start() {
+    this->clear();
+    this->useExceptions = this->io->useExceptions;
+    this->current = NULL;
+    this->stopping = false;
+
+    // Do not start if the floppy could not be opened
+    if (!this->io->ready()) {
+        this->setError(this->io->errorStr, this->io->errorCode, ERL_MINOR);
+        return;
+    }
+
+    this->worker = thread(&asyncIO::run, this);
+}
+
+//
+// Destructor
+//
+// Cancels everything that is still queued or in progress and waits
+// for the I/O thread to finish.
+//
+asyncIO::~asyncIO() {
+    {
+        lock_guard<mutex> guard(this->lock);
+        this->stopping = true;
+        for (int i=0; i<MAX_STREAMS; i++) this->io->abort(i);
+    }
+    this->wakeup.notify_all();
+    if (this->worker.joinable()) this->worker.join();
+
+    // Fail whatever never started
+    while (!this->queue.empty()) {
+        job * j = this->queue.front();
+        this->queue.pop_front();
+        this->complete(j, ERR_ABORTED);
+    }
+    delete this->io;
+}
+
+//
+// Call the completion callback and resolve the future
+//
+// The callback runs first, so that it has finished by the
+// time anybody waiting on the future wakes up.
+//
+void asyncIO::complete(job * j, int result) {
+    if (j->done) j->done(result);
+    j->result.set_value(result);
+    delete j;
+}
+
+//
+// Queue a job for the I/O thread
+//
+future<int> asyncIO::enqueue(job * j) {
+    future<int> f = j->result.get_future();
+
+    // Fail right away if we are not operational
+    if (!this->ready()) {
+        this->complete(j, ERR_NOTREADY);
+        return f;
+    }
+
+    {
+        lock_guard<mutex> guard(this->lock);
+        this->queue.push_back(j);
+    }
+    this->wakeup.notify_one();
+    return f;
+}
+
+//
+// The I/O thread
+//
+void asyncIO::run() {
+    while (1) {
+        job * j;
+        int lRet;
+
+        // Get the next job
+        {
+            unique_lock<mutex> guard(this->lock);
+            while (!this->stopping && this->queue.empty()) this->wakeup.wait(guard);
+            if (this->stopping) return;
+            j = this->queue.front();
+            this->queue.pop_front();
+            this->current = j;
+
+            // Start clean: Errors and stale abort requests belong to previous jobs
+            this->io->clear();
+            this->io->abort(j->streamID, false);
+        }
+
+        // Run it
+        try {
+            switch (j->type) {
+                case JOB_SEND:              lRet = this->io->send(j->buffer, j->size, j->streamID); break;
+                case JOB_SEND_STREAM:       lRet = this->io->send(j->in, j->streamID); break;
+                case JOB_RECEIVE:           lRet = this->io->receive(j->buffer, j->size, j->streamID); break;
+                case JOB_RECEIVE_STREAM:    lRet = this->io->receive(j->out, j->streamID); break;
+                default:                    lRet = ERR_INVALID; break;
+            }
+        } catch (ioexception & e) {
+            lRet = e.code;
+        }
+
+        // A cancelled message may be half way to the other end: tell it.
+        // Streaming sends do so themselves.
+        if ((j->type == JOB_SEND) && (lRet == ERR_ABORTED)) {
+            this->io->clear();
+            try {
+                this->io->sendAbort(j->streamID);
+            } catch (ioexception & e) {
+                // The job result is what counts
+            }
+        }
+
+        {
+            lock_guard<mutex> guard(this->lock);
+            this->current = NULL;
+        }
+        this->complete(j, lRet);
+    }
+}
+
+//
+// Cancel the transfers of a stream
+//
+// Queued transfers complete with ERR_ABORTED right away. The one in
+// progress, if any, is asked to abort. A send in progress tells the
+// other end with the bAborted bit.
+//
+// @return  The number of transfers cancelled
+//
+int asyncIO::cancel(unsigned short streamID) {
+    deque<job *> cancelled;
+    int count = 0;
+
+    streamID %= MAX_STREAMS;
+    {
+        lock_guard<mutex> guard(this->lock);
+        for (deque<job *>::iterator it = this->queue.begin(); it != this->queue.end(); ) {
+            if ((*it)->streamID == streamID) {
+                cancelled.push_back(*it);
+                it = this->queue.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if ((this->current != NULL) && (this->current->streamID == streamID)) {
+            this->io->abort(streamID);
+            count++;
+        }
+    }
+
+    // Complete outside the lock, callbacks may queue more work
+    count += cancelled.size();
+    for (size_t i=0; i<cancelled.size(); i++)
+        this->complete(cancelled[i], ERR_ABORTED);
+    return count;
+}
+
+//
+// ==[ Transfers ]====================================================
+//
+
+future<int> asyncIO::send_async(const char * buffer, int size, int streamID, io_completion done) {
+    job * j = new job();
+    j->type = JOB_SEND;
+    j->buffer = (char *) buffer;
+    j->size = size;
+    j->streamID = streamID % MAX_STREAMS;
+    j->done = done;
+    return this->enqueue(j);
+}
+
+future<int> asyncIO::send_async(istream * stream, unsigned short id, io_completion done) {
+    job * j = new job();
+    j->type = JOB_SEND_STREAM;
+    j->in = stream;
+    j->streamID = id % MAX_STREAMS;
+    j->done = done;
+    return this->enqueue(j);
+}
+
+future<int> asyncIO::receive_async(char * buffer, int size, int streamID, io_completion done) {
+    job * j = new job();
+    j->type = JOB_RECEIVE;
+    j->buffer = buffer;
+    j->size = size;
+    j->streamID = streamID % MAX_STREAMS;
+    j->done = done;
+    return this->enqueue(j);
+}
+
+future<int> asyncIO::receive_async(ostream * stream, unsigned short id, io_completion done) {
+    job * j = new job();
+    j->type = JOB_RECEIVE_STREAM;
+    j->out = stream;
+    j->streamID = id % MAX_STREAMS;
+    j->done = done;
+    return this->enqueue(j);
+}
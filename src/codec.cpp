@@ -0,0 +1,256 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   codec.cpp
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Payload compression codecs
+//
+
+#include <string.h>
+
+#if !defined FPIO_NO_ZLIB && defined __has_include
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define FPIO_HAVE_ZLIB
+#endif
+#endif
+
+#include "../includes/codec.h"
+
+using namespace fpio;
+
+//
+// ==[ Built-in LZ codec ]============================================
+//
+// A byte-oriented LZ77 in the style of LZ4. The input is a list of
+// sequences, each made of:
+//
+//   token      4 bits literal count, 4 bits match length - 4
+//   [length]   more literal count bytes if the count was 15 (255 = more)
+//   literals
+//   offset     2 bytes, little endian (not in the last sequence)
+//   [length]   more match length bytes if the length was 15
+//
+// The last sequence only carries literals and ends the input.
+//
+
+static const int LZ_MIN_MATCH   = 4;
+static const int LZ_HASH_BITS   = 14;
+static const int LZ_MAX_OFFSET  = 65535;
+
+static inline unsigned int lzRead32(const unsigned char * p) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline unsigned int lzHash(unsigned int v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+//
+// Write a length that did not fit in its token nibble
+//
+static inline bool lzPutLength(unsigned char ** op, unsigned char * opEnd, int len) {
+    while (len >= 255) {
+        if (*op >= opEnd) return false;
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    if (*op >= opEnd) return false;
+    *(*op)++ = (unsigned char)len;
+    return true;
+}
+
+//
+// Emit one sequence (matchLen = 0 for the last one)
+//
+static bool lzPutSequence(unsigned char ** op, unsigned char * opEnd, const unsigned char * lit, int litLen, int offset, int matchLen) {
+    int ml = (matchLen > 0) ? matchLen - LZ_MIN_MATCH : 0;
+
+    if (*op >= opEnd) return false;
+    *(*op)++ = (unsigned char)(((litLen < 15 ? litLen : 15) << 4) | (ml < 15 ? ml : 15));
+    if ((litLen >= 15) && !lzPutLength(op, opEnd, litLen - 15)) return false;
+
+    if (opEnd - *op < litLen) return false;
+    memcpy(*op, lit, litLen);
+    *op += litLen;
+    if (matchLen == 0) return true;
+
+    if (opEnd - *op < 2) return false;
+    *(*op)++ = (unsigned char)(offset & 0xFF);
+    *(*op)++ = (unsigned char)(offset >> 8);
+    if ((ml >= 15) && !lzPutLength(op, opEnd, ml - 15)) return false;
+    return true;
+}
+
+static int lzEncode(const unsigned char * src, int szSrc, unsigned char * dst, int szDst) {
+    int table[1 << LZ_HASH_BITS];
+    unsigned char * op = dst, * opEnd = dst + szDst;
+    int ip = 0, anchor = 0;
+    int limit = szSrc - LZ_MIN_MATCH;
+
+    memset(table, 0, sizeof(table));
+    while (ip < limit) {
+        unsigned int v = lzRead32(src + ip);
+        unsigned int h = lzHash(v);
+        int ref = table[h];
+        table[h] = ip;
+
+        // No match here, move on
+        if ((ref >= ip) || (ip - ref > LZ_MAX_OFFSET) || (lzRead32(src + ref) != v)) {
+            ip++;
+            continue;
+        }
+
+        // Extend the match as far as it goes
+        int len = LZ_MIN_MATCH;
+        while ((ip + len < szSrc) && (src[ref + len] == src[ip + len])) len++;
+
+        if (!lzPutSequence(&op, opEnd, src + anchor, ip - anchor, ip - ref, len)) return -1;
+        ip += len;
+        anchor = ip;
+    }
+
+    // Whatever is left goes out as literals
+    if (!lzPutSequence(&op, opEnd, src + anchor, szSrc - anchor, 0, 0)) return -1;
+    return op - dst;
+}
+
+static int lzDecode(const unsigned char * src, int szSrc, unsigned char * dst, int szDst) {
+    const unsigned char * ip = src, * ipEnd = src + szSrc;
+    unsigned char * op = dst, * opEnd = dst + szDst;
+
+    while (ip < ipEnd) {
+        unsigned int token = *ip++;
+        int len = token >> 4;
+
+        // Literals
+        if (len == 15) {
+            unsigned char b;
+            do {
+                if (ip >= ipEnd) return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        if ((ipEnd - ip < len) || (opEnd - op < len)) return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+
+        // The last sequence has no match
+        if (ip == ipEnd) break;
+
+        // Match
+        if (ipEnd - ip < 2) return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > op - dst)) return -1;
+
+        len = token & 15;
+        if (len == 15) {
+            unsigned char b;
+            do {
+                if (ip >= ipEnd) return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += LZ_MIN_MATCH;
+        if (opEnd - op < len) return -1;
+
+        // Matches may overlap their own output
+        const unsigned char * ref = op - offset;
+        if (offset >= len) {
+            memcpy(op, ref, len);
+            op += len;
+        } else {
+            while (len-- > 0) *op++ = *ref++;
+        }
+    }
+
+    return op - dst;
+}
+
+//
+// ==[ Codec dispatch ]===============================================
+//
+
+bool fpio::codec_available(int codec) {
+    switch (codec) {
+        case CODEC_NONE:
+        case CODEC_LZ:
+            return true;
+#if defined FPIO_HAVE_ZLIB
+        case CODEC_ZLIB:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+int fpio::codec_encode(int codec, const char * src, int szSrc, char * dst, int szDst) {
+    switch (codec) {
+        case CODEC_NONE:
+            if (szSrc > szDst) return -1;
+            memcpy(dst, src, szSrc);
+            return szSrc;
+
+        case CODEC_LZ:
+            return lzEncode((const unsigned char *)src, szSrc, (unsigned char *)dst, szDst);
+
+#if defined FPIO_HAVE_ZLIB
+        case CODEC_ZLIB: {
+            // Fastest level: we are after bandwidth, not the last byte
+            uLongf szOut = szDst;
+            if (compress2((Bytef *)dst, &szOut, (const Bytef *)src, szSrc, Z_BEST_SPEED) != Z_OK) return -1;
+            return szOut;
+        }
+#endif
+
+        default:
+            return -1;
+    }
+}
+
+int fpio::codec_decode(int codec, const char * src, int szSrc, char * dst, int szDst) {
+    switch (codec) {
+        case CODEC_NONE:
+            if (szSrc > szDst) return -1;
+            memcpy(dst, src, szSrc);
+            return szSrc;
+
+        case CODEC_LZ:
+            return lzDecode((const unsigned char *)src, szSrc, (unsigned char *)dst, szDst);
+
+#if defined FPIO_HAVE_ZLIB
+        case CODEC_ZLIB: {
+            uLongf szOut = szDst;
+            if (uncompress((Bytef *)dst, &szOut, (const Bytef *)src, szSrc) != Z_OK) return -1;
+            return szOut;
+        }
+#endif
+
+        default:
+            return -1;
+    }
+}
@@ -0,0 +1,222 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   coroutine.cpp
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// C++20 coroutine interface on top of floppyIO
+//
+
+#include "../includes/coroutine.h"
+
+using namespace std;
+using namespace fpio;
+
+// ===================================================================
+// task
+// ===================================================================
+
+task::task(task && other) noexcept {
+    this->handle = other.handle;
+    other.handle = nullptr;
+}
+
+task & task::operator=(task && other) noexcept {
+    if (this != &other) {
+        if (this->handle) this->handle.destroy();
+        this->handle = other.handle;
+        other.handle = nullptr;
+    }
+    return *this;
+}
+
+task::~task() {
+    if (this->handle) this->handle.destroy();
+}
+
+bool task::done() const {
+    return !this->handle || this->handle.done();
+}
+
+//
+// The value the task returned
+//
+// Rethrows the exception that ended the task, if any.
+//
+int task::result() const {
+    if (this->handle.promise().error) rethrow_exception(this->handle.promise().error);
+    return this->handle.promise().value;
+}
+
+// ===================================================================
+// io_awaitable
+// ===================================================================
+
+io_awaitable::io_awaitable(executor * owner, bool input, char * buffer, int size, int streamID) {
+    this->owner = owner;
+    this->input = input;
+    this->buffer = buffer;
+    this->size = size;
+    this->streamID = streamID % MAX_STREAMS;
+    this->result = ERR_AGAIN;
+}
+
+//
+// Try to complete the operation without waiting
+//
+// @return  TRUE if the operation completed (successfully or not)
+//
+bool io_awaitable::attempt() {
+    floppyIO * io = this->owner->io;
+    try {
+        if (this->input)
+            this->result = io->poll_receive(this->buffer, this->size, this->streamID);
+        else
+            this->result = io->poll_send(this->buffer, this->size, this->streamID);
+    } catch (ioexception & e) {
+        this->result = e.code;
+    }
+    return (this->result != ERR_AGAIN);
+}
+
+//
+// Complete right away if nothing else is queued before us
+//
+bool io_awaitable::await_ready() {
+    if (this->owner->isBlocked(this)) return false;
+    return this->attempt();
+}
+
+void io_awaitable::await_suspend(coroutine_handle<> h) {
+    this->handle = h;
+    this->owner->pending.push_back(this);
+}
+
+// ===================================================================
+// executor
+// ===================================================================
+
+//
+// Constructor
+//
+executor::executor(floppyIO * io) {
+    this->clear();
+    this->io = io;
+    this->useExceptions = io->useExceptions;
+}
+
+//
+// Destructor
+//
+// Tasks that did not finish are destroyed without being resumed.
+//
+executor::~executor() {
+    this->pending.clear();
+    this->runnable.clear();
+    this->tasks.clear();
+}
+
+//
+// Queue a task to be started by run()
+//
+void executor::spawn(task && t) {
+    if (t.done()) return;
+    this->runnable.push_back(t.handle);
+    this->tasks.push_back(std::move(t));
+}
+
+//
+// Awaitable send, see floppyIO::send()
+//
+io_awaitable executor::send(char * buffer, int size, int streamID) {
+    return io_awaitable(this, false, buffer, size, streamID);
+}
+
+//
+// Awaitable receive, see floppyIO::receive()
+//
+io_awaitable executor::receive(char * buffer, int size, int streamID) {
+    return io_awaitable(this, true, buffer, size, streamID);
+}
+
+//
+// Check if an operation on the same stream and direction is waiting
+// ahead of the given one, so the order of the messages is kept
+//
+bool executor::isBlocked(io_awaitable * a) {
+    for (io_awaitable * p : this->pending) {
+        if (p == a) return false;
+        if ((p->input == a->input) && (p->streamID == a->streamID)) return true;
+    }
+    return false;
+}
+
+//
+// Run the spawned tasks until all of them are finished
+//
+// Returns ERR_TIMEOUT if tasks are still waiting for I/O when the
+// timeout (in milliseconds, 0 = forever) expires. They can be
+// continued with another call to run().
+//
+// If a task ended with an exception, it is rethrown from here.
+//
+int executor::run(int timeout) {
+    unsigned long long tExpired = 0;
+    if (timeout > 0) tExpired = monotonic_time() + (unsigned long long)timeout * 1000;
+
+    for (unsigned int i=0; ; ) {
+
+        // Run everything that is ready
+        bool progress = !this->runnable.empty();
+        while (!this->runnable.empty()) {
+            coroutine_handle<> h = this->runnable.front();
+            this->runnable.pop_front();
+            h.resume();
+        }
+
+        // Collect finished tasks
+        for (list<task>::iterator it = this->tasks.begin(); it != this->tasks.end(); ) {
+            if (!it->done()) { ++it; continue; }
+            exception_ptr error = it->handle.promise().error;
+            it = this->tasks.erase(it);
+            if (error) rethrow_exception(error);
+        }
+
+        // Retry the pending operations, oldest first
+        for (deque<io_awaitable *>::iterator it = this->pending.begin(); it != this->pending.end(); ) {
+            io_awaitable * a = *it;
+            if (this->isBlocked(a) || !a->attempt()) { ++it; continue; }
+            it = this->pending.erase(it);
+            this->runnable.push_back(a->handle);
+            progress = true;
+        }
+
+        // Everything done?
+        if (this->runnable.empty() && this->pending.empty()) return ERR_NONE;
+        if (progress) { i = 0; continue; }
+
+        // Check for timeout
+        if ((tExpired != 0) && (monotonic_time() >= tExpired))
+            return this->setError("Timeout while running the I/O tasks!", ERR_TIMEOUT, ERL_ERROR);
+
+        // Wait for the other end
+        this->io->waitForChange(i++, tExpired);
+
+    }
+}
@@ -0,0 +1,140 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   crc32c.cpp
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// CRC32C (Castagnoli) checksums
+//
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined __x86_64__ || defined __i386__
+#include <nmmintrin.h>
+#define FPIO_HAVE_SSE42
+#endif
+
+#include "../includes/crc32c.h"
+
+using namespace fpio;
+
+// Reflected Castagnoli polynomial
+static const uint32_t CRC32C_POLY = 0x82F63B78;
+
+//
+// ==[ Portable version ]=============================================
+//
+// Slicing-by-8: eight 256-entry tables, eight bytes per step.
+//
+
+static uint32_t crcTable[8][256];
+
+static void crcInitTable() {
+    for (int i=0; i<256; i++) {
+        uint32_t c = i;
+        for (int k=0; k<8; k++) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : (c >> 1);
+        crcTable[0][i] = c;
+    }
+    for (int i=0; i<256; i++) {
+        uint32_t c = crcTable[0][i];
+        for (int t=1; t<8; t++) {
+            c = crcTable[0][c & 0xFF] ^ (c >> 8);
+            crcTable[t][i] = c;
+        }
+    }
+}
+
+static uint32_t crcPortable(uint32_t crc, const unsigned char * p, size_t szLen) {
+    while ((szLen > 0) && ((uintptr_t)p & 7)) {
+        crc = crcTable[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        szLen--;
+    }
+    while (szLen >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crcTable[7][lo & 0xFF] ^ crcTable[6][(lo >> 8) & 0xFF] ^
+              crcTable[5][(lo >> 16) & 0xFF] ^ crcTable[4][lo >> 24] ^
+              crcTable[3][hi & 0xFF] ^ crcTable[2][(hi >> 8) & 0xFF] ^
+              crcTable[1][(hi >> 16) & 0xFF] ^ crcTable[0][hi >> 24];
+        p += 8;
+        szLen -= 8;
+    }
+    while (szLen-- > 0)
+        crc = crcTable[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+//
+// ==[ SSE4.2 version ]===============================================
+//
+
+#if defined FPIO_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crcSSE42(uint32_t crc, const unsigned char * p, size_t szLen) {
+    while ((szLen > 0) && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        szLen--;
+    }
+#if defined __x86_64__
+    uint64_t c64 = crc;
+    while (szLen >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+        p += 8;
+        szLen -= 8;
+    }
+    crc = (uint32_t)c64;
+#endif
+    while (szLen >= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        szLen -= 4;
+    }
+    while (szLen-- > 0)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+//
+// ==[ Dispatch ]=====================================================
+//
+
+typedef uint32_t (*crc_function)(uint32_t, const unsigned char *, size_t);
+
+// Pick the implementation once
+static crc_function crcSelect() {
+#if defined FPIO_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) return crcSSE42;
+#endif
+    crcInitTable();
+    return crcPortable;
+}
+
+unsigned int fpio::crc32c(unsigned int crc, const void * data, size_t szLen) {
+    static const crc_function impl = crcSelect();
+    return ~impl(~crc, (const unsigned char *)data, szLen);
+}
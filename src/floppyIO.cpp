@@ -29,6 +29,7 @@
 //
 
 #include <string.h>
+#include <unistd.h>
 #include <iostream>
 
 #include "../includes/floppyIO.h"
@@ -39,79 +40,387 @@ using namespace fpio;
 //
 // Constructor
 //
-floppyIO::floppyIO(const char * file, int flags) : flpdisk(file, flags) {
+floppyIO::floppyIO(const char * file, int flags, int syncPolicy) : flpdisk(file, flags, syncPolicy) {
+    this->initIO(file, flags);
+}
+
+//
+// Constructor with explicit disk layout
+//
+floppyIO::floppyIO(const char * file, int flags, const disk_layout & layout, int syncPolicy) : flpdisk(file, flags, layout, syncPolicy) {
+    this->initIO(file, flags);
+}
+
+//
+// Common initialization
+//
+void floppyIO::initIO(const char * file, int flags) {
 
     this->syncTimeout = SYNC_TIMEOUT;
+    this->waitStrategy = WAIT_ADAPTIVE;
     this->useSynchronization = (( flags & O_SYNCHRONIZED) != 0);
+    this->useChecksum = (( flags & O_CHECKSUM) != 0);
+    memset(this->inCB, 0, sizeof(this->inCB));
+    memset(this->outCB, 0, sizeof(this->outCB));
+    memset(this->inHDR, 0, sizeof(this->inHDR));
+    memset(this->outHDR, 0, sizeof(this->outHDR));
+    memset(this->inSlot, 0, sizeof(this->inSlot));
+    memset(this->outSlot, 0, sizeof(this->outSlot));
+    for (int i=0; i<MAX_STREAMS; i++) this->abortPending[i] = false;
+    this->trafficIn = 0;
+    this->trafficOut = 0;
+
+    this->staging = NULL;
+    this->inStaging = NULL;
+    memset(this->viewPending, 0, sizeof(this->viewPending));
+    memset(this->codecOut, 0, sizeof(this->codecOut));
+    this->encBuffer = NULL;
+    this->rawBuffer = NULL;
+    this->szRawBuffer = 0;
+
+    // File-backed images can wake us up on change instead of polling.
+    // Not mapped ones: writes through a mapping are never notified.
+    this->watch = NULL;
+    if ((flags & (O_DEVICE | O_MMAP)) == 0) this->watch = new watcher(file);
+
+    // Offer our capabilities. The host is opened first, so a client
+    // can settle them right away. The host picks up the offer of the
+    // client before its first message after it (see settleCaps).
+    if (((this->layout.options & LO_SUPERBLOCK) != 0) && this->ready()) {
+        if ((flags & O_CLIENT) != 0) this->negotiate(this->syncTimeout);
+        else this->publishCaps();
+    }
+
+}
+
+//
+// Map a codec to the capability that lets the other end decode it
+//
+static int codecCap(int codec) {
+    switch (codec) {
+        case CODEC_LZ:   return CAP_CODEC_LZ;
+        case CODEC_ZLIB: return CAP_CODEC_ZLIB;
+        default:         return 0;
+    }
+}
+
+//
+// The capabilities this end offers
+//
+// We can check checksums and decode whatever codec this build has,
+// but acknowledgements change the protocol, so they are only offered
+// when enabled.
+//
+int floppyIO::localCaps() {
+    int caps = flpdisk::localCaps() | CAP_CHECKSUM;
+    if (this->useSynchronization) caps |= CAP_SYNCHRONIZED | CAP_REBALANCE;
+    if (codec_available(CODEC_LZ)) caps |= CAP_CODEC_LZ;
+    if (codec_available(CODEC_ZLIB)) caps |= CAP_CODEC_ZLIB;
+    return caps;
+}
+
+//
+// Stop using what the other end does not support
+//
+void floppyIO::applyCaps(int caps) {
+    flpdisk::applyCaps(caps);
+    if ((caps & CAP_SYNCHRONIZED) == 0) this->useSynchronization = false;
+    if (((caps & CAP_CHECKSUM) == 0) || !this->useExtended) this->useChecksum = false;
+    for (int i=0; i<MAX_STREAMS; i++) {
+        if (!this->useExtended || ((caps & codecCap(this->codecOut[i])) == 0)) this->codecOut[i] = CODEC_NONE;
+    }
+}
+
+//
+// Move the split between the two directions toward the busier one
+//
+// Both ends call this at the same quiescent point, e.g. once a request
+// was answered: nothing may be in flight in either direction. The host
+// gives pctIn percent of the image to the messages it receives, or, if
+// pctIn is negative, splits it like the payload bytes each direction
+// carried since the last rebalance (the input is only counted with
+// extended headers). The client follows. Needs a LO_SUPERBLOCK layout
+// and CAP_REBALANCE on both ends.
+//
+// @return  ERR_NONE, ERR_AGAIN if the host still has input to
+//          receive, or an error code
+//
+int floppyIO::rebalance(int timeout, int pctIn) {
+    if (!this->ready()) return ERR_NOTREADY;
+    if ((this->caps < 0) || ((this->caps & CAP_REBALANCE) == 0))
+        return this->setError("Rebalancing was not negotiated", "Usage error", ERR_INVALID, ERL_ERROR);
+
+    // Our messages must have been read
+    int lRet = this->drain(timeout);
+    if (lRet < 0) return lRet;
+    if (this->isClient) return this->acceptLayout(timeout);
+
+    // ...and theirs too
+    ctrlbyte cb;
+    for (unsigned int i=0; i<this->layout.numSlots; i++) {
+        lRet = this->get_in_cb(&cb, i);
+        if (lRet < 0) return lRet;
+        if (cb.bDataPresent) return ERR_AGAIN;
+    }
+
+    // Split like the traffic, or keep the split if there was none
+    if (pctIn < 0) {
+        unsigned long long total = this->trafficIn + this->trafficOut;
+        if (total > 0) pctIn = (int)(this->trafficIn * 100 / total);
+        else pctIn = (int)layout_split(this->layout);
+    }
+
+    disk_layout next = make_layout(this->layout.numSlots / this->layout.numStreams, this->layout.options, this->layout.szImage, pctIn);
+    return this->proposeLayout(next, timeout);
+}
 
+//
+// Start over on a new layout
+//
+// Both ends cleared their slots, so the rings restart at the first
+// slot and the buffers sized for the old layout go.
+//
+void floppyIO::layoutChanged() {
+    memset(this->inCB, 0, sizeof(this->inCB));
+    memset(this->outCB, 0, sizeof(this->outCB));
+    memset(this->inSlot, 0, sizeof(this->inSlot));
+    memset(this->outSlot, 0, sizeof(this->outSlot));
+    memset(this->viewPending, 0, sizeof(this->viewPending));
+    if (this->staging != NULL) delete[] this->staging;
+    if (this->inStaging != NULL) delete[] this->inStaging;
+    if (this->encBuffer != NULL) delete[] this->encBuffer;
+    this->staging = NULL;
+    this->inStaging = NULL;
+    this->encBuffer = NULL;
+    this->trafficIn = 0;
+    this->trafficOut = 0;
 }
 
 //
 // Destructor
 //
 floppyIO::~floppyIO() {
+    if (this->watch != NULL) delete this->watch;
+    if (this->staging != NULL) delete[] this->staging;
+    if (this->inStaging != NULL) delete[] this->inStaging;
+    if (this->encBuffer != NULL) delete[] this->encBuffer;
+    if (this->rawBuffer != NULL) delete[] this->rawBuffer;
+}
+
+//
+// Wait for the other end to change something
+//
+// The first waitStrategy.spinCount iterations return immediately.
+// After that we sleep with an exponential backoff between sleepMinUs
+// and sleepMaxUs. On images with a watcher the sleep is spent blocked
+// on it instead, so a change ends it early; a peer writing through a
+// mapping is not seen by the watcher, and is noticed after the sleep.
+// Never sleeps past the given deadline (0 = no deadline).
+//
+void floppyIO::waitForChange(unsigned int iteration, unsigned long long tExpired) {
+    unsigned long long usWait;
+
+    // Spin
+    if (iteration < this->waitStrategy.spinCount) return;
+    iteration -= this->waitStrategy.spinCount;
+
+    // How long to block
+    bool useWatch = (this->watch != NULL) && this->watch->active();
+    usWait = (unsigned long long)this->waitStrategy.sleepMinUs << ((iteration < 20) ? iteration : 20);
+    if (usWait > this->waitStrategy.sleepMaxUs) usWait = this->waitStrategy.sleepMaxUs;
+    if (useWatch && (usWait > (unsigned long long)WATCH_SLICE_MS * 1000)) usWait = WATCH_SLICE_MS * 1000;
+
+    // Do not oversleep the deadline
+    if (tExpired != 0) {
+        unsigned long long tNow = monotonic_time();
+        if (tNow >= tExpired) return;
+        if (tExpired - tNow < usWait) usWait = tExpired - tNow;
+    }
 
+    if (useWatch) {
+        this->watch->wait(usWait);
+    } else if (usWait > 0) {
+        usleep(usWait);
+    }
 }
 
 //
-// Wait for data to be available on input
+// Wait for a control byte to reach the given state
 //
-int floppyIO::waitForSyncIn(unsigned short streamID, int timeout) {
+// Polls the input or output control byte of the given slot until its
+// bDataPresent bit equals 'present' and, if matchID is set, the stream
+// ID matches. The timeout is in milliseconds (0 = forever).
+//
+// Returns ERR_ABORTED if an abort was requested for streamID.
+//
+// With stats enabled the time spent here goes to the wait histogram,
+// and with tracing it shows up as a wait span.
+//
+int floppyIO::waitForControl(bool input, unsigned int slot, int streamID, bool matchID, bool present, int timeout, ctrlbyte * cb) {
+    if ((this->stats == NULL) && (this->tracer == NULL)) return this->pollControl(input, slot, streamID, matchID, present, timeout, cb);
+
+    trace_span span(this->tracer, input ? TE_WAIT_IN : TE_WAIT_OUT, (streamID < 0) ? 0 : streamID);
+    unsigned long long tStart = monotonic_time();
+    int lRet = this->pollControl(input, slot, streamID, matchID, present, timeout, cb);
+    if (this->stats != NULL) {
+        this->stats->waitTime.add(monotonic_time() - tStart);
+        if (lRet == ERR_TIMEOUT) this->stats->timeouts++;
+    }
+    if (!input && (lRet == ERR_NONE)) this->traceEvent(TE_ACK, (streamID < 0) ? 0 : streamID, slot);
+    return lRet;
+}
+
+//
+// The polling loop of waitForControl
+//
+int floppyIO::pollControl(bool input, unsigned int slot, int streamID, bool matchID, bool present, int timeout, ctrlbyte * cb) {
+    unsigned long long tExpired = 0;
     int lRet = ERR_NONE;
-    time_t tExpired = time (NULL) + timeout;
 
-    // Get last status of inCB
-    this->get_in_cb(&inCB);
+    if (timeout > 0) tExpired = monotonic_time() + (unsigned long long)timeout * 1000;
 
     // Wait until expired, error, or forever.
-    while (((timeout == 0) || ( time(NULL) <= tExpired)) && (lRet == ERR_NONE)) {
+    for (unsigned int i=0; ; i++) {
+
+        // Update control byte
+        if (this->stats != NULL) this->stats->polls++;
+        lRet = input ? this->get_in_cb(cb, slot) : this->get_out_cb(cb, slot);
+        if (lRet < 0) return lRet;
 
-        // Wait until we have data available
-        if (inCB.bDataPresent != 0) {
-            if (inCB.sID == streamID) break; // If the streamID matches the one specified, quit
+        // Check if we reached the state we want
+        if ((cb->bDataPresent != 0) == present) {
+            if (!matchID || (cb->sID == streamID)) return ERR_NONE;
         }
 
-        // Update inCB
-        lRet = this->get_in_cb(&inCB);
+        // Check if we should give up
+        if ((streamID >= 0) && this->abortPending[streamID]) return ERR_ABORTED;
 
-        // Sleep for a while, not to overload CPU
-        usleep(1000);
+        // Check for timeout
+        if ((tExpired != 0) && (monotonic_time() >= tExpired)) break;
+
+        // Wait for the other end, not to overload CPU
+        this->waitForChange(i, tExpired);
 
     }
 
-    // Check for timeout
-    if ((timeout != 0) && ( time(NULL) > tExpired)) 
-        lRet = this->setError("Timeout while waiting for input!", ERR_TIMEOUT, ERL_ERROR);
+    // Timed out
+    if (input)
+        return this->setError("Timeout while waiting for input!", ERR_TIMEOUT, ERL_ERROR);
+    return this->setError("Timeout while waiting for output to be read!", ERR_TIMEOUT, ERL_ERROR);
+}
 
-    return lRet;    
+//
+// Find the slot group of a stream
+//
+// On multiplexed layouts every stream has its own group of slots,
+// otherwise all streams share group 0.
+//
+unsigned int floppyIO::streamGroup(unsigned short streamID) {
+    if (this->layout.numStreams <= 1) return 0;
+    return streamID % this->layout.numStreams;
 }
 
 //
-// Wait for data to be available on output
+// Find the next slot to read (input) or write (output) for a stream
 //
-int floppyIO::waitForSyncOut(unsigned short streamID, int timeout) {
-    int lRet = ERR_NONE;
-    time_t tExpired = time (NULL) + timeout;
+// The offset parameter looks further back (negative) or forward
+// in the ring of the stream group.
+//
+unsigned int floppyIO::streamSlot(bool input, unsigned short streamID, int offset) {
+    unsigned int group = this->streamGroup(streamID);
+    unsigned int perGroup = this->layout.numSlots / this->layout.numStreams;
+    unsigned int pos = input ? this->inSlot[group] : this->outSlot[group];
+    return group * perGroup + (pos + perGroup + offset) % perGroup;
+}
 
-    // Wait until expired, error, or forever.
-    while (((timeout == 0) || ( time(NULL) <= tExpired)) && (lRet == ERR_NONE)) {
-        lRet = this->get_out_cb(&outCB);
+//
+// Move to the next slot of the stream group
+//
+void floppyIO::advanceSlot(bool input, unsigned short streamID) {
+    unsigned int group = this->streamGroup(streamID);
+    unsigned int perGroup = this->layout.numSlots / this->layout.numStreams;
+    unsigned int * pos = input ? &this->inSlot[group] : &this->outSlot[group];
+    *pos = (*pos + 1) % perGroup;
+}
 
-        // Wait until we have data available
-        if (outCB.bDataPresent == 0) {
-            if (outCB.sID == streamID) break; // If the streamID matches the one specified, quit
-        }
+//
+// Wait for data to be available on input
+//
+int floppyIO::waitForSyncIn(unsigned short streamID, int timeout) {
+    streamID %= MAX_STREAMS;
+    return this->waitForControl(true, this->streamSlot(true, streamID), streamID, true, true, timeout, &inCB[streamID]);
+}
 
-        // Sleep for a while, not to overload CPU
-        usleep(1000);
+//
+// Wait for the last output to be read
+//
+int floppyIO::waitForSyncOut(unsigned short streamID, int timeout) {
+    ctrlbyte cb;
+    streamID %= MAX_STREAMS;
+    return this->waitForControl(false, this->streamSlot(false, streamID, -1), streamID, true, false, timeout, &cb);
+}
 
+//
+// Wait until all output slots were read by the other end
+//
+// If a stream ID is given, only the slots that stream can use are
+// checked. On multiplexed layouts that leaves the other streams out.
+//
+int floppyIO::drain(int timeout, int streamID) {
+    unsigned int first = 0, count = this->layout.numSlots;
+    ctrlbyte cb;
+    int lRet;
+
+    if (streamID >= 0) {
+        count = this->layout.numSlots / this->layout.numStreams;
+        first = this->streamGroup(streamID) * count;
     }
+    for (unsigned int i=first; i<first+count; i++) {
+        lRet = this->waitForControl(false, i, streamID, false, false, timeout, &cb);
+        if (lRet < 0) return lRet;
+    }
+    return ERR_NONE;
+}
 
-    // Check for timeout
-    if ((timeout != 0) && ( time(NULL) > tExpired)) 
-        lRet = this->setError("Timeout while waiting for output to be read!", ERR_TIMEOUT, ERL_ERROR);
+//
+// Request the transfer on the given stream to stop
+//
+// Any wait on the stream returns ERR_ABORTED, and a streaming send
+// notifies the other end by publishing a bAborted marker. Safe to
+// call from another thread. Calling it with state=false withdraws
+// a request that was not honoured yet.
+//
+void floppyIO::abort(unsigned short streamID, bool state) {
+    this->abortPending[streamID % MAX_STREAMS] = state;
+}
+
+//
+// Notify the other end that the stream was aborted
+//
+// Publishes an empty message with the bAborted and bEndOfData bits
+// as soon as the next slot of the stream is free. The other end gets
+// ERR_ABORTED from a plain receive, and a badbit from a streaming one.
+//
+int floppyIO::sendAbort(unsigned short streamID) {
+    ctrlbyte cb;
+    int lRet;
+
+    streamID %= MAX_STREAMS;
+    this->abortPending[streamID] = false;
+
+    // The abort we are reporting may have been left as our error
+    // (see reserve), which would keep us from publishing anything
+    if (this->errorCode == ERR_ABORTED) this->clear();
 
-    return lRet;    
+    lRet = this->waitForControl(false, this->streamSlot(false, streamID), streamID, false, false, this->syncTimeout, &cb);
+    if (lRet < 0) return lRet;
+
+    outCB[streamID].bEndOfData = 1;
+    outCB[streamID].bAborted = 1;
+    lRet = this->send((char*)"", 0, streamID);
+    outCB[streamID].bEndOfData = 0;
+    outCB[streamID].bAborted = 0;
+    return (lRet < 0) ? lRet : ERR_NONE;
 }
 
 //
@@ -121,31 +430,339 @@ int floppyIO::waitForSyncOut(unsigned short streamID, int timeout) {
 // before calling this.
 //
 int floppyIO::send(char * buffer, int size, int streamID) {
+    streamID %= MAX_STREAMS;
+    trace_span span(this->tracer, TE_SEND, streamID);
     int lRet;
 
-    // Write the output data
-    lRet = write_out(buffer, size);
+    lRet = this->settleCaps();
+    if (lRet<0) return lRet;
+    lRet = this->waitForSlot(streamID);
+    if (lRet<0) return lRet;
+
+    // Publish the message
+    size = this->post(buffer, size, streamID);
+    if (size<0) return size;
+
+    lRet = this->waitForRead(streamID);
+    if (lRet<0) return lRet;
+
+    // Return the bytes sent
+    return size;
+    
+}
+
+//
+// Send a message gathered from several buffers
+//
+// The pieces (at most MAX_IOV) are written straight into the output
+// buffer one after the other, so callers do not need to assemble the
+// message first. Otherwise the same as send(char*, int, int).
+//
+// @return  The bytes sent or an error code
+//
+int floppyIO::send(const struct iovec * iov, int count, int streamID) {
+    streamID %= MAX_STREAMS;
+    trace_span span(this->tracer, TE_SEND, streamID);
+    int size, lRet;
+
+    lRet = this->settleCaps();
+    if (lRet<0) return lRet;
+    lRet = this->waitForSlot(streamID);
+    if (lRet<0) return lRet;
+
+    size = this->postv(iov, count, streamID);
+    if (size<0) return size;
+
+    lRet = this->waitForRead(streamID);
+    if (lRet<0) return lRet;
+
+    return size;
+}
+
+//
+// Receive a message into several buffers
+//
+// Fills the buffers (at most MAX_IOV) in order with the message, which
+// is read directly from the input buffer.
+//
+// @return  The bytes received or an error code
+//
+int floppyIO::receive(const struct iovec * iov, int count, int streamID) {
+    streamID %= MAX_STREAMS;
+    trace_span span(this->tracer, TE_RECEIVE, streamID);
+    unsigned int slot;
+    int size = 0, lRet;
+
+    // Wait for sync input
+    if (this->useSynchronization) {
+        lRet = waitForSyncIn(streamID, this->syncTimeout);
+        if (lRet<0) return lRet;
+    }
+
+    // Fetch control byte and extended header
+    lRet = this->settleCaps();
+    if (lRet<0) return lRet;
+    slot = this->streamSlot(true, streamID);
+    lRet = fetch_in(&inCB[streamID], &inHDR[streamID], slot);
     if (lRet<0) return lRet;
 
-    // If we have extended information, write extended header
-    if (this->useExtended) {
-        outHDR.szLength = size;
-        set_out_xhdr(&outHDR);
+    // Compressed or checksummed messages are loaded and then scattered
+    if (this->needsLoad(streamID)) {
+        const char * raw;
+        lRet = this->loadIn(slot, streamID, &raw);
+        if (lRet<0) return lRet;
+        for (int i=0; (i<count) && (size<lRet); i++) {
+            int szPiece = (int)iov[i].iov_len;
+            if (szPiece > lRet - size) szPiece = lRet - size;
+            memcpy(iov[i].iov_base, raw + size, szPiece);
+            size += szPiece;
+        }
+        this->clearInput(streamID);
+        if (inCB[streamID].bAborted) return ERR_ABORTED;
+        return size;
     }
 
-    // Write output control byte
-    outCB.sID = streamID;
-    outCB.bDataPresent = 1;
-    outCB.bExtended = this->useExtended ? 1 : 0;
-    set_out_cb(&outCB);
+    // Read no more than the message
+    for (int i=0; i<count; i++) size += iov[i].iov_len;
+    if (this->useExtended && ((int)inHDR[streamID].szLength < size)) size = inHDR[streamID].szLength;
+    lRet = read_inv(iov, count, size, slot);
+    if (lRet<0) return lRet;
 
-    // Wait for sync output
-    if (this->useSynchronization)
-        lRet = waitForSyncOut(streamID, this->syncTimeout);
+    // Without the extended header the message ends at the null-termination
+    if (!this->useExtended) {
+        size = 0;
+        for (int i=0; (i<count) && (size<lRet); i++) {
+            int szPiece = (int)iov[i].iov_len;
+            if (szPiece > lRet - size) szPiece = lRet - size;
+            int szText = strnlen((char *)iov[i].iov_base, szPiece);
+            size += szText;
+            if (szText < szPiece) break;
+        }
+        lRet = size;
+    }
 
-    // Return the bytes sent
+    this->clearInput(streamID);
+
+    // The other end gave up on the stream
+    if (inCB[streamID].bAborted) return ERR_ABORTED;
     return lRet;
-    
+}
+
+//
+// Choose how the messages sent on a stream are compressed
+//
+// Every message says in its extended header how it was encoded, so
+// the other end decodes whatever it receives, as long as it was built
+// with the same codec. Messages that do not get smaller are sent as-is.
+//
+int floppyIO::setCodec(int codec, int streamID) {
+    if (!this->useExtended)
+        return this->setError("Compression requires the extended protocol", "Usage error", ERR_INVALID, ERL_ERROR);
+    if (!codec_available(codec))
+        return this->setError("Codec not available", "Usage error", ERR_INVALID, ERL_ERROR);
+    if ((codec != CODEC_NONE) && (this->caps >= 0) && ((this->caps & codecCap(codec)) == 0))
+        return this->setError("The other end cannot decode this codec", "Negotiated capabilities", ERR_INVALID, ERL_ERROR);
+    this->codecOut[streamID % MAX_STREAMS] = codec;
+    return ERR_NONE;
+}
+
+//
+// Space for one buffer of encoded payload
+//
+char * floppyIO::codecBuffer() {
+    if (this->encBuffer == NULL) {
+        int szMax = (this->layout.szBufferIn > this->layout.szBufferOut) ? this->layout.szBufferIn : this->layout.szBufferOut;
+        this->encBuffer = new char[szMax];
+    }
+    return this->encBuffer;
+}
+
+//
+// Space for a whole message before encoding
+//
+char * floppyIO::rawSpace(int size) {
+    if (size > this->szRawBuffer) {
+        if (this->rawBuffer != NULL) delete[] this->rawBuffer;
+        this->rawBuffer = new char[size];
+        this->szRawBuffer = size;
+    }
+    return this->rawBuffer;
+}
+
+//
+// Check if the message in the slot has to be read whole before use,
+// because it is compressed or has a checksum
+//
+bool floppyIO::needsLoad(int streamID) {
+    extended_header * hdr = &inHDR[streamID];
+    return this->useExtended && ((hdr->codec != CODEC_NONE) || (hdr->hflags & HF_CHECKSUM));
+}
+
+//
+// Read the whole message waiting in a slot, verify and decode it
+//
+// Points 'data' at the message. If the checksum does not match, the
+// header and payload are read again a few times, in case we raced
+// with the other end or with a cache. If it still does not match,
+// ERR_CHECKSUM is returned and the message is left in place, so that
+// it can be received again; the instance stays ready for that. A
+// message that cannot be decoded is dropped, so the stream can go on.
+//
+// @return  The message size or an error code
+//
+int floppyIO::loadIn(unsigned int slot, int streamID, const char ** data) {
+    extended_header * hdr = &inHDR[streamID];
+    const char * payload;
+    int lRet;
+
+    for (int i=0; ; i++) {
+
+        // Payload, in place if we can
+        if (this->in_buffer_view(slot) != NULL) {
+            lRet = this->peek_in(&payload, hdr->szLength, slot);
+        } else {
+            payload = this->codecBuffer();
+            lRet = read_in(this->encBuffer, hdr->szLength, slot);
+        }
+        if (lRet<0) return lRet;
+
+        if (!(hdr->hflags & HF_CHECKSUM) || (this->checksum(hdr, payload, lRet) == hdr->crc)) break;
+        if (i >= CHECKSUM_RETRIES) return ERR_CHECKSUM;
+
+        // Give the other end a moment and read everything again
+        this->waitForChange(this->waitStrategy.spinCount + i, 0);
+        lRet = fetch_in(&inCB[streamID], hdr, slot);
+        if (lRet<0) return lRet;
+
+    }
+
+    if (hdr->codec == CODEC_NONE) {
+        *data = payload;
+        return lRet;
+    }
+
+    if (!codec_available(hdr->codec) || (hdr->szRaw > (unsigned int)SZ_CODEC_MAX_RAW)) {
+        this->clearInput(streamID);
+        return this->setError("Unable to decode the message", "Unknown codec or size", ERR_INPUT, ERL_ERROR);
+    }
+
+    lRet = codec_decode(hdr->codec, payload, lRet, this->rawSpace(hdr->szRaw), hdr->szRaw);
+    if (lRet != (int)hdr->szRaw) {
+        this->clearInput(streamID);
+        return this->setError("Unable to decode the message", "Corrupt payload", ERR_INPUT, ERL_ERROR);
+    }
+
+    *data = this->rawBuffer;
+    return lRet;
+}
+
+//
+// CRC32C over the extended header (without the checksum) and payload
+//
+unsigned int floppyIO::checksum(const extended_header * hdr, const char * payload, int size) {
+    extended_header tmp = *hdr;
+    tmp.crc = 0;
+    return crc32c(crc32c(0, tmp.value, SZ_EXTENDED_HEADER), payload, size);
+}
+
+//
+// Add the checksum to an outgoing message
+//
+// Covers the payload as it will be committed, so it is clipped to the
+// output buffer like commit_out does.
+//
+void floppyIO::checksumOut(int streamID, const struct iovec * iov, int count) {
+    extended_header * hdr = &outHDR[streamID];
+    int szLeft = this->layout.szBufferOut - SZ_EXTENDED_HEADER;
+    unsigned int crc;
+
+    hdr->hflags |= HF_CHECKSUM;
+    hdr->crc = 0;
+    crc = crc32c(0, hdr->value, SZ_EXTENDED_HEADER);
+    for (int i=0; (i<count) && (szLeft>0); i++) {
+        int szPiece = ((int)iov[i].iov_len < szLeft) ? (int)iov[i].iov_len : szLeft;
+        crc = crc32c(crc, iov[i].iov_base, szPiece);
+        szLeft -= szPiece;
+    }
+    hdr->crc = crc;
+}
+
+//
+// Reserve space for the next message of a stream
+//
+// Returns a pointer where up to 'size' bytes of the message can be
+// written in place, to be published with commit(). On memory-mapped
+// images this points straight into the output buffer, otherwise into
+// a staging buffer that commit() writes out with a single write.
+// There is one staging buffer, so only reserve one message at a time
+// when the image is not mapped.
+//
+// On ring layouts this waits (syncTimeout) for the slot to be free.
+// If the stream is aborted meanwhile, errorCode is ERR_ABORTED, and
+// clear() (or sendAbort) makes the instance ready again.
+//
+// @return  The writable space, or NULL on error
+//
+char * floppyIO::reserve(int size, int streamID) {
+    streamID %= MAX_STREAMS;
+    if (this->settleCaps() < 0) return NULL;
+    int szMax = this->layout.szBufferOut - (this->useExtended ? SZ_EXTENDED_HEADER : 0);
+
+    if ((size < 0) || (size > szMax)) {
+        this->setError("Reserved size exceeds the output buffer", "Usage error", ERR_INVALID, ERL_ERROR);
+        return NULL;
+    }
+
+    // Aborts are reported through errorCode, without raising
+    int lRet = this->waitForSlot(streamID);
+    if (lRet == ERR_ABORTED) this->setError("Transfer aborted", ERR_ABORTED, ERL_MINOR);
+    if (lRet < 0) return NULL;
+    this->traceEvent(TE_RESERVE, streamID, this->streamSlot(false, streamID), size);
+
+    // Write in place if we can
+    char * ptr = this->out_buffer_view(this->streamSlot(false, streamID));
+    if (ptr != NULL) return ptr;
+
+    if (this->staging == NULL) this->staging = new char[szMax];
+    return this->staging;
+}
+
+//
+// Publish the message written in the space returned by reserve()
+//
+// @return  The bytes sent or an error code
+//
+int floppyIO::commit(int size, int streamID) {
+    streamID %= MAX_STREAMS;
+    trace_span span(this->tracer, TE_SEND, streamID);
+    int lRet;
+
+    // In-place messages only need the header and the control byte
+    size = this->post((this->out_buffer_view() != NULL) ? NULL : this->staging, size, streamID);
+    if (size<0) return size;
+
+    lRet = this->waitForRead(streamID);
+    if (lRet<0) return lRet;
+
+    return size;
+}
+
+//
+// On ring layouts wait for the next slot of the stream to be free
+// instead of waiting for each message to be read
+//
+int floppyIO::waitForSlot(int streamID) {
+    ctrlbyte slotCB;
+    if (!this->useSynchronization || (this->layout.version == LAYOUT_CLASSIC)) return ERR_NONE;
+    return waitForControl(false, this->streamSlot(false, streamID), streamID, false, false, this->syncTimeout, &slotCB);
+}
+
+//
+// On the classic layout wait for the message to be read
+//
+int floppyIO::waitForRead(int streamID) {
+    if (!this->useSynchronization || (this->layout.version != LAYOUT_CLASSIC)) return ERR_NONE;
+    return waitForSyncOut(streamID, this->syncTimeout);
 }
 
 //
@@ -156,38 +773,287 @@ int floppyIO::send(char * buffer, int size, int streamID) {
 //
 int floppyIO::receive(char * buffer, int size, int streamID) {
     int lRet;
+    streamID %= MAX_STREAMS;
+    trace_span span(this->tracer, TE_RECEIVE, streamID);
 
     // Wait for sync input
-    if (this->useSynchronization)
+    if (this->useSynchronization) {
         lRet = waitForSyncIn(streamID, this->syncTimeout);
+        if (lRet<0) return lRet;
+    }
 
-    // Read the input data
-    lRet = read_in(buffer, size);
+    return this->consume(buffer, size, streamID);
+}
+
+//
+// Send data if it can be done without waiting
+//
+// Publishes the message only if the next slot of the stream is free.
+// Never waits for the other end to read it.
+//
+// @return  The bytes sent, ERR_AGAIN if the slot is still in use, or
+//          ERR_ABORTED if the stream was aborted
+//
+int floppyIO::poll_send(char * buffer, int size, int streamID) {
+    ctrlbyte cb;
+    int lRet;
+    streamID %= MAX_STREAMS;
+    if (this->abortPending[streamID]) return ERR_ABORTED;
+
+    if (this->stats != NULL) this->stats->polls++;
+    lRet = this->get_out_cb(&cb, this->streamSlot(false, streamID));
+    if (lRet<0) return lRet;
+    if (cb.bDataPresent) return ERR_AGAIN;
+
+    lRet = this->settleCaps();
+    if (lRet<0) return lRet;
+    return this->post(buffer, size, streamID);
+}
+
+//
+// Receive data if there is some waiting
+//
+// @return  The bytes received, ERR_AGAIN if there is no data for this
+//          stream yet, or ERR_ABORTED if the stream was aborted
+//
+int floppyIO::poll_receive(char * buffer, int size, int streamID) {
+    ctrlbyte cb;
+    int lRet;
+    streamID %= MAX_STREAMS;
+    if (this->abortPending[streamID]) return ERR_ABORTED;
+
+    if (this->stats != NULL) this->stats->polls++;
+    lRet = this->get_in_cb(&cb, this->streamSlot(true, streamID));
+    if (lRet<0) return lRet;
+    if (!cb.bDataPresent || (cb.sID != streamID)) return ERR_AGAIN;
+
+    return this->consume(buffer, size, streamID);
+}
+
+//
+// Publish a message on the next slot of the stream
+//
+int floppyIO::post(char * buffer, int size, int streamID) {
+    int codec = this->codecOut[streamID];
+
+    // Encode it if the stream uses compression and that pays off
+    if ((codec != CODEC_NONE) && (size > 0) && (size <= SZ_CODEC_MAX_RAW)) {
+        const char * raw = (buffer != NULL) ? buffer : this->out_buffer_view(this->streamSlot(false, streamID));
+        int szEnc = codec_encode(codec, raw, size, this->codecBuffer(), this->layout.szBufferOut - SZ_EXTENDED_HEADER);
+        if ((szEnc >= 0) && (szEnc < size))
+            return this->postCoded(this->encBuffer, szEnc, size, codec, streamID);
+    }
+
+    return this->postCoded(buffer, size, size, CODEC_NONE, streamID);
+}
+
+//
+// Publish an already encoded message
+//
+// @return  The bytes of the message before encoding
+//
+int floppyIO::postCoded(const char * data, int size, int szRaw, int codec, int streamID) {
+    unsigned int slot = this->streamSlot(false, streamID);
+    int lRet;
+
+    this->prepareOut(size, streamID);
+    outHDR[streamID].codec = codec;
+    outHDR[streamID].szRaw = szRaw;
+
+    if (this->useChecksum && this->useExtended) {
+        struct iovec iov;
+        iov.iov_base = (void *)((data != NULL) ? data : this->out_buffer_view(slot));
+        iov.iov_len = (size < 0) ? 0 : size;
+        this->checksumOut(streamID, &iov, 1);
+    }
+
+    // Commit payload, header and control byte in that order
+    lRet = commit_out(data, size, &outCB[streamID], &outHDR[streamID], slot);
     if (lRet<0) return lRet;
+    this->trafficOut += lRet;
+    this->advanceSlot(false, streamID);
+    return (codec == CODEC_NONE) ? lRet : szRaw;
+}
+
+//
+// Publish a message gathered from several buffers
+//
+int floppyIO::postv(const struct iovec * iov, int count, int streamID) {
+    unsigned int slot = this->streamSlot(false, streamID);
+    int size = 0;
+    for (int i=0; i<count; i++) size += iov[i].iov_len;
+
+    // The codecs need the message in one piece
+    if ((this->codecOut[streamID] != CODEC_NONE) && (size <= SZ_CODEC_MAX_RAW)) {
+        char * raw = this->rawSpace(size);
+        for (int i=0, ofs=0; i<count; ofs += iov[i].iov_len, i++)
+            memcpy(raw + ofs, iov[i].iov_base, iov[i].iov_len);
+        return this->post(raw, size, streamID);
+    }
 
-    // Locate the end of the data
-    if (this->useExtended) {
-        get_in_xhdr(&inHDR);
-        lRet = inHDR.szLength;
+    this->prepareOut(size, streamID);
+    if (this->useChecksum && this->useExtended) this->checksumOut(streamID, iov, count);
+
+    size = commit_outv(iov, count, &outCB[streamID], &outHDR[streamID], slot);
+    if (size<0) return size;
+    this->trafficOut += size;
+    this->advanceSlot(false, streamID);
+    return size;
+}
+
+//
+// Prepare extended header and output control byte
+//
+void floppyIO::prepareOut(int size, int streamID) {
+    ctrlbyte * cb = &outCB[streamID];
+    outHDR[streamID].szLength = size;
+    outHDR[streamID].codec = CODEC_NONE;
+    outHDR[streamID].hflags = 0;
+    outHDR[streamID].szRaw = size;
+    outHDR[streamID].crc = 0;
+    cb->sID = streamID;
+    cb->bDataPresent = 1;
+    cb->bExtended = this->useExtended ? 1 : 0;
+}
+
+//
+// Read the message in the next slot of the stream and release the slot
+//
+int floppyIO::consume(char * buffer, int size, int streamID) {
+    unsigned int slot = this->streamSlot(true, streamID);
+    ctrlbyte * cb = &inCB[streamID];
+    extended_header * hdr = &inHDR[streamID];
+    int lRet;
+
+    // Fetch control byte and extended header
+    lRet = this->settleCaps();
+    if (lRet<0) return lRet;
+    lRet = fetch_in(cb, hdr, slot);
+    if (lRet<0) return lRet;
+
+    // Read the input data
+    if (this->needsLoad(streamID)) {
+        const char * raw;
+        lRet = this->loadIn(slot, streamID, &raw);
+        if (lRet<0) return lRet;
+        if (lRet > size) lRet = size;
+        memcpy(buffer, raw, lRet);
+    } else if (this->useExtended) {
+        if ((int)hdr->szLength < size) size = hdr->szLength;
+        lRet = read_in(buffer, size, slot);
+        if (lRet<0) return lRet;
     } else {
-        lRet = strlen(buffer);
+        lRet = read_in(buffer, size, slot);
+        if (lRet<0) return lRet;
+        lRet = strnlen(buffer, lRet);
     }
 
-    // Data are no more present
-    inCB.bDataPresent=0;
-    set_in_cb(&inCB);
+    this->clearInput(streamID);
+
+    // The other end gave up on the stream
+    if (cb->bAborted) return ERR_ABORTED;
 
     // Return the bytes sent
     return lRet;
     
 }
 
+//
+// Data are no more present, move to the next slot
+//
+void floppyIO::clearInput(int streamID) {
+    ctrlbyte * cb = &inCB[streamID];
+    if (cb->bDataPresent) {
+        if (this->stats != NULL) this->stats->messagesIn[streamID]++;
+        if (this->useExtended) this->trafficIn += inHDR[streamID].szLength;
+        this->traceEvent(TE_CONSUMED, streamID, this->streamSlot(true, streamID));
+        cb->bDataPresent=0;
+        set_in_cb(cb, this->streamSlot(true, streamID));
+        this->advanceSlot(true, streamID);
+    }
+}
+
+//
+// Receive a message without copying it
+//
+// Waits for the message like receive() and points 'data' at it. On
+// memory-mapped images this is the input buffer itself, otherwise a
+// buffer holding exactly the message bytes. The view stays valid
+// until release() is called for the stream, which frees the slot for
+// the next message. There is one buffer, so only view one message at
+// a time when the image is not mapped or the message is compressed.
+//
+// @return  The message size or an error code
+//
+int floppyIO::receive_view(const char ** data, int streamID) {
+    streamID %= MAX_STREAMS;
+    trace_span span(this->tracer, TE_RECEIVE, streamID);
+    int szMax = this->layout.szBufferIn - (this->useExtended ? SZ_EXTENDED_HEADER : 0);
+    unsigned int slot;
+    int size, lRet;
+
+    if (this->viewPending[streamID])
+        return this->setError("The previous view was not released", "Usage error", ERR_INVALID, ERL_ERROR);
+
+    // Wait for sync input
+    if (this->useSynchronization) {
+        lRet = waitForSyncIn(streamID, this->syncTimeout);
+        if (lRet<0) return lRet;
+    }
+
+    // Fetch control byte and extended header
+    lRet = this->settleCaps();
+    if (lRet<0) return lRet;
+    slot = this->streamSlot(true, streamID);
+    lRet = fetch_in(&inCB[streamID], &inHDR[streamID], slot);
+    if (lRet<0) return lRet;
+
+    // Only the message itself, if we know its size
+    size = szMax;
+    if (this->useExtended && ((int)inHDR[streamID].szLength < size)) size = inHDR[streamID].szLength;
+
+    if (this->needsLoad(streamID)) {
+        size = this->loadIn(slot, streamID, data);
+        if (size<0) return size;
+    } else if (this->in_buffer_view(slot) != NULL) {
+        size = this->peek_in(data, size, slot);
+        if (size<0) return size;
+    } else {
+        if (this->inStaging == NULL) this->inStaging = new char[szMax];
+        size = read_in(this->inStaging, size, slot);
+        if (size<0) return size;
+        *data = this->inStaging;
+    }
+    if (!this->useExtended) size = strnlen(*data, size);
+
+    this->viewPending[streamID] = true;
+    return size;
+}
+
+//
+// Release the message returned by receive_view()
+//
+int floppyIO::release(int streamID) {
+    streamID %= MAX_STREAMS;
+    if (!this->viewPending[streamID])
+        return this->setError("Nothing to release", "Usage error", ERR_INVALID, ERL_ERROR);
+    this->viewPending[streamID] = false;
+    this->clearInput(streamID);
+    return ERR_NONE;
+}
+
 //
 // Streaming Sending Data
 //
 int floppyIO::send(istream * stream, unsigned short id) {
+    id %= MAX_STREAMS;
     int sz_chunk = this->layout.szBufferOut;
-    int sentLength, rd, lRet;
+    int sentLength = 0, rd, lRet = 0;
+    char * chunk;
+
+    // Settle what we use before the chunk size and codec are chosen
+    lRet = this->settleCaps();
+    if (lRet<0) return lRet;
 
     // Resize chunk if we are using extended header
     if (this->useExtended)
@@ -196,29 +1062,42 @@ int floppyIO::send(istream * stream, unsigned short id) {
     // Check if stream is not good
     if (!stream->good()) return this->setError("Unable to open input stream!", ERR_INPUT, ERL_ERROR);
 
+    // Compressed streams are chunked on the encoded size
+    if (this->codecOut[id] != CODEC_NONE) return this->sendCoded(stream, id);
+
     // While stream is good, start processing
-    char * inBuffer = new char[sz_chunk+1];
     while (stream->good()) {
 
-        // Zero the input buffer (Plus one null-termination byte)
-        memset(inBuffer, 0, sz_chunk+1);
+        // Stop if we were asked to
+        if (this->abortPending[id]) {
+            this->sendAbort(id);
+            return this->setError("Transfer aborted", ERR_ABORTED, ERL_ERROR);
+        }
 
-        // Read data 
-        stream->read(inBuffer, sz_chunk);
+        // Read data straight into the output buffer
+        chunk = this->reserve(sz_chunk, id);
+        if (chunk == NULL) {
+            if (this->errorCode == ERR_ABORTED) {
+                this->sendAbort(id);
+                return this->setError("Transfer aborted", ERR_ABORTED, ERL_ERROR);
+            }
+            return this->errorCode;
+        }
+        stream->read(chunk, sz_chunk);
         rd = stream->gcount();
 
         // Check status
         if (stream->eof()) {
             // EOF? Mark end-of-data on the current block
-            outCB.bEndOfData = 1;
-            outCB.bAborted = 0;
+            outCB[id].bEndOfData = 1;
+            outCB[id].bAborted = 0;
 
         } else if (stream->fail()) {
             // Got fail without getting eof? Something went wrong
 
             // Notify the remote end that we failed the transmittion
-            outCB.bEndOfData = 1;
-            outCB.bAborted = 1;
+            outCB[id].bEndOfData = 1;
+            outCB[id].bAborted = 1;
             lRet = this->send((char*)"", 1, id); // Send Zero data and the appropriate control bits
 
             // Return error            
@@ -227,62 +1106,193 @@ int floppyIO::send(istream * stream, unsigned short id) {
         } else {
 
             // Not end of data yet
-            outCB.bEndOfData = 0;
-            outCB.bAborted = 0;
+            outCB[id].bEndOfData = 0;
+            outCB[id].bAborted = 0;
 
         }
 
-        // Count bytes written
-        if (rd > 0) {
-            lRet = this->send(inBuffer, rd, id);
-            if (lRet<0) return lRet; // Error occured
+        // Count bytes written (the end-of-data marker is sent even if empty)
+        if ((rd > 0) || (outCB[id].bEndOfData == 1)) {
+
+            // Without the extended header the other end finds the
+            // end of a short chunk by its null-termination
+            lRet = rd;
+            if (!this->useExtended && (rd < sz_chunk)) chunk[lRet++] = 0;
+
+            lRet = this->commit(lRet, id);
+            if (lRet == ERR_ABORTED) {
+                this->sendAbort(id);
+                return this->setError("Transfer aborted", ERR_ABORTED, ERL_ERROR);
+            }
+            if (lRet<0) { // Error occured
+                return lRet;
+            }
+            sentLength+=rd;
         }
-                
-        sentLength+=lRet;
 
     }
 
+    // Make sure everything in flight was read
+    lRet = this->drainStream(id);
+    if (lRet<0) return lRet;
+
     // Completed
     return sentLength;
 
 }
 
+//
+// Send a stream with compression
+//
+// Reads ahead as much as we expect to fit in one buffer once encoded,
+// guessing from the ratio of the previous chunk. What does not fit is
+// kept for the next message, so every round trip carries about one
+// full buffer of encoded data.
+//
+int floppyIO::sendCoded(istream * stream, unsigned short id) {
+    int codec = this->codecOut[id];
+    int sz_chunk = this->layout.szBufferOut - SZ_EXTENDED_HEADER;
+
+    // The other end takes no encoded message of more than
+    // SZ_CODEC_MAX_RAW bytes, however large the buffers are
+    int szMax = SZ_CODEC_MAX_RAW;
+    int szMin = (sz_chunk < szMax) ? sz_chunk : szMax;
+    int szTarget = (sz_chunk < szMax / 2) ? sz_chunk * 2 : szMax;
+    int sentLength = 0, fill = 0, n, szEnc, lRet;
+    bool eof = false;
+    char * enc = this->codecBuffer();
+    char * raw = new char[szMax];
+
+    while (!eof || (fill > 0)) {
+
+        // Stop if we were asked to
+        if (this->abortPending[id]) {
+            delete[] raw;
+            this->sendAbort(id);
+            return this->setError("Transfer aborted", ERR_ABORTED, ERL_ERROR);
+        }
+
+        // Top up the data to encode
+        if (!eof && (fill < szTarget)) {
+            stream->read(raw + fill, szTarget - fill);
+            fill += stream->gcount();
+            if (stream->eof()) {
+                eof = true;
+            } else if (stream->fail()) {
+                // Notify the remote end that we failed the transmittion
+                delete[] raw;
+                outCB[id].bEndOfData = 1;
+                outCB[id].bAborted = 1;
+                this->send((char*)"", 1, id);
+                return this->setError("Unable to open input stream!", ERR_INPUT, ERL_ERROR);
+            }
+        }
+
+        // Find the largest part that fits in one buffer once encoded
+        n = fill;
+        szEnc = codec_encode(codec, raw, n, enc, sz_chunk);
+        while ((szEnc < 0) && (n > szMin)) {
+            n = n / 4 * 3;
+            if (n < szMin) n = szMin;
+            szEnc = codec_encode(codec, raw, n, enc, sz_chunk);
+        }
+
+        // The message with the last bytes carries the end-of-data
+        outCB[id].bEndOfData = (eof && (n == fill)) ? 1 : 0;
+        outCB[id].bAborted = 0;
+
+        // Send it encoded, or as-is if that is not any smaller
+        lRet = this->waitForSlot(id);
+        if (lRet >= 0) {
+            if ((szEnc >= 0) && (szEnc < n))
+                lRet = this->postCoded(enc, szEnc, n, codec, id);
+            else
+                lRet = this->postCoded(raw, n, n, CODEC_NONE, id);
+        }
+        if (lRet >= 0) lRet = this->waitForRead(id);
+        if (lRet == ERR_ABORTED) {
+            delete[] raw;
+            this->sendAbort(id);
+            return this->setError("Transfer aborted", ERR_ABORTED, ERL_ERROR);
+        }
+        if (lRet < 0) {
+            delete[] raw;
+            return lRet;
+        }
+        sentLength += n;
+
+        // Keep the rest for the next message
+        memmove(raw, raw + n, fill - n);
+        fill -= n;
+
+        // Aim the next read at a slightly less than full buffer
+        if (szEnc > 0) {
+            long long guess = (long long)n * sz_chunk / szEnc / 8 * 7;
+            szTarget = (guess < szMin) ? szMin : ((guess > szMax) ? szMax : (int)guess);
+        }
+
+    }
+    delete[] raw;
+
+    lRet = this->drainStream(id);
+    if (lRet<0) return lRet;
+    return sentLength;
+}
+
+//
+// Wait until the messages of a stream in flight were read
+//
+int floppyIO::drainStream(unsigned short id) {
+    int lRet;
+    if (this->useSynchronization && (this->layout.version != LAYOUT_CLASSIC)) {
+        lRet = this->drain(this->syncTimeout, id);
+        if (lRet == ERR_ABORTED) {
+            this->abortPending[id] = false;
+            return this->setError("Transfer aborted", ERR_ABORTED, ERL_ERROR);
+        }
+        if (lRet<0) return lRet;
+    }
+    return ERR_NONE;
+}
+
 // 
 // Streaming Receiving Data
 //
 int floppyIO::receive(ostream * stream, unsigned short id) {
-    int sz_chunk = this->layout.szBufferOut;
-    int receivedLength, rd, lRet;
-
-    // Resize chunk if we are using extended header
-    if (this->useExtended)
-        sz_chunk -= SZ_EXTENDED_HEADER;
+    id %= MAX_STREAMS;
+    int receivedLength, lRet;
+    const char * chunk;
 
-    // Prepare and start reading loop
-    char * inBuffer = new char[sz_chunk+1];
+    // Start reading loop
     receivedLength = 0;
     while (1) {
 
         // Try to read chunk
-        lRet = receive( inBuffer, sz_chunk, id );
+        lRet = receive_view( &chunk, id );
+        if (lRet == ERR_ABORTED) { // We gave up
+            this->abortPending[id] = false;
+            stream->setstate(ostream::badbit);
+            return this->setError("Transfer aborted", ERR_ABORTED, ERL_ERROR);
+        }
         if (lRet < 0) { // Error
             stream->setstate(ostream::badbit);
             break;
         }
 
-        // Push the data to the stream
+        // Push the data to the stream straight from the input buffer
         if (lRet > 0) {
-            stream->write(inBuffer, lRet);
+            stream->write(chunk, lRet);
             stream->flush();
             receivedLength += lRet;
         }
+        this->release(id);
 
         // Check if stream was aborted or finished
-        if (inCB.bAborted == 1) {
+        if (inCB[id].bAborted == 1) {
             stream->setstate(ostream::badbit | ostream::eofbit);
             break;
             
-        } else if (inCB.bEndOfData == 1) {
+        } else if (inCB[id].bEndOfData == 1) {
             stream->setstate(ostream::eofbit);
             break;
         }
@@ -24,45 +24,287 @@
 // 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
 
 #if defined __linux__
 #include <sys/ioctl.h>
 #include <linux/fd.h>
 #include <linux/fs.h>
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
 #endif
 
 #include "../includes/flpdisk.h"
+#include "../includes/crc32c.h"
 
 using namespace fpio;
 using namespace std;
 
+// Synchronization points (see flpdisk::syncAt)
+static const int SP_READ_CONTROL    = 0;    // Before reading a control byte (or anything fetched with it)
+static const int SP_READ_DATA       = 1;    // Before reading a header or payload
+static const int SP_WRITE           = 2;    // After a standalone write
+static const int SP_COMMIT          = 3;    // Ordering barrier between payload and control byte
+
+// How much of the image reset() zeroes per write
+static const unsigned int SZ_RESET_CHUNK = 1024 * 1024;
+
+//
+// The part of szSpace that goes to the input of the host
+//
+static unsigned int splitInput(unsigned int szSpace, unsigned int pctIn) {
+    if (pctIn < SPLIT_MIN) pctIn = SPLIT_MIN;
+    if (pctIn > SPLIT_MAX) pctIn = SPLIT_MAX;
+    return (unsigned int)((unsigned long long)szSpace * pctIn / 100);
+}
+
+//
+// The percentage of its space a layout gives to the input of the host
+//
+// The space of a ring layout is what follows the superblock, so this
+// is the pctIn that make_layout() was given, give or take rounding.
+//
+unsigned int fpio::layout_split(const disk_layout & layout) {
+    unsigned long long szIn, szSpace;
+    if (layout.version == LAYOUT_CLASSIC) {
+        szIn = layout.szBufferIn + 1;
+        szSpace = layout.szImage;
+    } else {
+        if (layout.ofsControlOut <= layout.ofsControlIn) return SPLIT_EVEN;
+        szIn = layout.ofsControlOut - layout.ofsControlIn;
+        szSpace = layout.szImage - layout.ofsControlIn;
+    }
+    if (szSpace == 0) return SPLIT_EVEN;
+    return (unsigned int)((szIn * 100 + szSpace / 2) / szSpace);
+}
+
+//
+// Build the default layout for an image of the given size
+//
+// Like FPIO_DEFAULT_STRUCTURE: one control byte and one buffer per
+// direction, the input of the host taking pctIn percent of the image.
+//
+disk_layout fpio::make_classic_layout(unsigned int szImage, unsigned int pctIn) {
+    disk_layout layout = FPIO_DEFAULT_STRUCTURE;
+    unsigned int szIn = splitInput(szImage, pctIn);
+    layout.ofsBufferOut = szIn+2;
+    layout.szBufferIn = szIn-1;
+    layout.szBufferOut = szImage-szIn-2;
+    layout.szImage = szImage;
+    return layout;
+}
+
+//
+// Build a ring layout
+//
+// Each half of the image is split into numSlots equally sized
+// slots. Every slot starts with its own control byte, followed
+// by the buffer (and the extended header, if used).
+//
+// With LO_MULTIPLEX every stream ID gets numSlots slots of its own.
+//
+// With LO_ALIGNED the stride is rounded down to whole blocks
+// (SZ_ALIGNED_BLOCK) and the buffer starts OFS_ALIGNED_BUFFER bytes
+// after the control byte, so that control byte, header and the first
+// payload bytes of a slot share one sector, and no block is shared by
+// two slots.
+//
+// With LO_SUPERBLOCK the first sector (block, if aligned) holds the
+// superblock and the two halves are made of what is left.
+//
+// The input of the host takes pctIn percent of the space, so the
+// two directions can have slots of different sizes. Bigger images
+// give bigger slots, not more of them.
+//
+disk_layout fpio::make_layout(unsigned int numSlots, int options, unsigned int szImage, unsigned int pctIn) {
+    disk_layout layout;
+    unsigned int numStreams = ((options & LO_MULTIPLEX) != 0) ? MAX_STREAMS : 1;
+
+    // Keep the number of slots sane
+    if (numSlots < 1) numSlots = 1;
+    if (numSlots > MAX_SLOTS / numStreams) numSlots = MAX_SLOTS / numStreams;
+    numSlots *= numStreams;
+
+    unsigned int ofsBase = 0;
+    if ((options & LO_SUPERBLOCK) != 0) ofsBase = ((options & LO_ALIGNED) != 0) ? SZ_ALIGNED_BLOCK : SZ_SECTOR;
+    unsigned int szHalfIn = splitInput(szImage - ofsBase, pctIn);
+    unsigned int szHalfOut = szImage - ofsBase - szHalfIn;
+    unsigned int ofsBuffer = 1;
+    if ((options & LO_ALIGNED) != 0) {
+        szHalfIn -= szHalfIn % SZ_ALIGNED_BLOCK;
+        szHalfOut -= szHalfOut % SZ_ALIGNED_BLOCK;
+        ofsBuffer = OFS_ALIGNED_BUFFER;
+    }
+    unsigned int szStrideIn = szHalfIn / numSlots;
+    unsigned int szStrideOut = szHalfOut / numSlots;
+    if ((options & LO_ALIGNED) != 0) {
+        szStrideIn -= szStrideIn % SZ_ALIGNED_BLOCK;
+        szStrideOut -= szStrideOut % SZ_ALIGNED_BLOCK;
+    }
+
+    layout.ofsControlIn = ofsBase;
+    layout.ofsControlOut = ofsBase+szHalfIn;
+    layout.ofsBufferIn = ofsBase+ofsBuffer;
+    layout.ofsBufferOut = ofsBase+szHalfIn+ofsBuffer;
+
+    layout.szControlByte = 1;
+    layout.szBufferIn = szStrideIn-ofsBuffer;
+    layout.szBufferOut = szStrideOut-ofsBuffer;
+
+    layout.version = LAYOUT_RING;
+    layout.numSlots = numSlots;
+    layout.szStrideIn = szStrideIn;
+    layout.szStrideOut = szStrideOut;
+    layout.numStreams = numStreams;
+    layout.options = options & (LO_MULTIPLEX | LO_ALIGNED | LO_SUPERBLOCK);
+    layout.szImage = szImage;
+    return layout;
+}
+
+//
+// Check that every slot of a layout lies inside its image
+//
+static bool layoutFits(const disk_layout & layout) {
+    unsigned long long last = layout.numSlots - 1;
+    if ((layout.szImage < 2*SZ_SECTOR) || (layout.szImage > (unsigned int)SZ_IMAGE_MAX)) return false;
+    if ((layout.szBufferIn == 0) || (layout.szBufferOut == 0)) return false;
+    if (layout.ofsControlIn + last*layout.szStrideIn + layout.szControlByte > layout.szImage) return false;
+    if (layout.ofsControlOut + last*layout.szStrideOut + layout.szControlByte > layout.szImage) return false;
+    if (layout.ofsBufferIn + last*layout.szStrideIn + layout.szBufferIn > layout.szImage) return false;
+    if (layout.ofsBufferOut + last*layout.szStrideOut + layout.szBufferOut > layout.szImage) return false;
+
+    // Keep the superblock sector to itself
+    if ((layout.options & LO_SUPERBLOCK) != 0) {
+        if ((layout.ofsControlIn < SZ_SECTOR) || (layout.ofsControlOut < SZ_SECTOR)) return false;
+        if ((layout.ofsBufferIn < SZ_SECTOR) || (layout.ofsBufferOut < SZ_SECTOR)) return false;
+    }
+    return true;
+}
+
+//
+// Check that a layout can be used with direct I/O
+//
+// O_DIRECT writes whole blocks, so a write reads the blocks at its
+// edges and writes them back as they were. Whatever the other end
+// wrote to them in between is lost, unless every block is written
+// by one end at a time. A slot is handed over from one end to the
+// other, so that holds if no block spans two slots, or a slot and
+// the superblock. The superblock itself is written by one end at a
+// time too (see flpdisk::negotiate). Classic layouts keep both
+// control bytes in the first sector and never qualify.
+//
+static bool layoutDirect(const disk_layout & layout, unsigned int szAlign) {
+    if (layout.version != LAYOUT_RING) return false;
+    if ((layout.ofsControlIn % szAlign != 0) || (layout.ofsControlOut % szAlign != 0)) return false;
+    if ((layout.szStrideIn % szAlign != 0) || (layout.szStrideOut % szAlign != 0)) return false;
+    if (((layout.options & LO_SUPERBLOCK) != 0) && ((layout.ofsControlIn < szAlign) || (layout.ofsControlOut < szAlign))) return false;
+    return true;
+}
+
+//
+// Check the identification and checksum of a superblock
+//
+static bool superblockValid(const superblock & sb) {
+    if ((sb.magic != SB_MAGIC) || (sb.version != SB_VERSION)) return false;
+    if ((sb.layout.options & LO_SUPERBLOCK) == 0) return false;
+    return crc32c(0, &sb, offsetof(superblock, checksum)) == sb.checksum;
+}
+
+//
+// Swap the directions of a layout, turning the view of the host
+// into the view of the client
+//
+static void swapDirections(disk_layout & layout) {
+    unsigned int tmp;
+
+    // Swap control byte positions
+    tmp = layout.ofsControlOut;
+    layout.ofsControlOut = layout.ofsControlIn;
+    layout.ofsControlIn = tmp;
+
+    // Swap buffer positions
+    tmp = layout.ofsBufferOut;
+    layout.ofsBufferOut = layout.ofsBufferIn;
+    layout.ofsBufferIn = tmp;
+
+    // Swap buffer sizes
+    tmp = layout.szBufferOut;
+    layout.szBufferOut = layout.szBufferIn;
+    layout.szBufferIn = tmp;
+
+    // Swap slot strides
+    tmp = layout.szStrideOut;
+    layout.szStrideOut = layout.szStrideIn;
+    layout.szStrideIn = tmp;
+}
+
+//
+// FloppyIO Constructor
+//
+// Uses the default layout
+//
+flpdisk::flpdisk(const char * file, int flags, int syncPolicy) {
+    this->init(file, flags, FPIO_DEFAULT_STRUCTURE, syncPolicy);
+}
 
 //
 // FloppyIO Constructor
 //
+// Uses the given layout, as seen from the host. O_CLIENT
+// swaps the directions as usual.
+//
+flpdisk::flpdisk(const char * file, int flags, const disk_layout & layout, int syncPolicy) {
+    this->init(file, flags, layout, syncPolicy);
+}
+
 //
+// Open the floppy disk
 //
-flpdisk::flpdisk(const char * file, int flags) {
+void flpdisk::init(const char * file, int flags, const disk_layout & layout, int syncPolicy) {
     int lRet;
 
     // Use exceptions
     this->clear();
     this->fd=0;
+    this->map=NULL;
+    this->shadow=NULL;
+    this->dirty=NULL;
+    this->resets = 0;
     this->useDevice = false;
+    this->useDirect = false;
+    this->szAlign = SZ_SECTOR;
+    this->inFrames = NULL;
+    memset(this->inFrameValid, 0, sizeof(this->inFrameValid));
+    this->useInline = true;
+    this->isClient = ((flags & O_CLIENT) != 0);
+    this->capsPublished = false;
+    this->generation = 0;
+    this->caps = -1;
+    this->stats = NULL;
+    this->statsStore = NULL;
+    this->tracer = NULL;
+    this->syncPolicy = syncPolicy;
+    if ((flags & O_STATS) != 0) this->enableStats();
+    if ((flags & O_TRACE) != 0) this->enableTrace();
 
     // Update flags
     this->useExceptions=((flags & O_EXCEPTIONS) != 0);
     this->useExtended=((flags & O_EXTENDED) != 0);
 
-    // Prepare open flags
-    int oflags = O_RDWR | O_SYNC;
+    // Prepare open flags. Only the durable policies need synchronous writes.
+    int oflags = O_RDWR;
+    if ((syncPolicy == SYNC_PER_OPERATION) || (syncPolicy == SYNC_PER_COMMIT)) oflags |= O_SYNC;
     if ((flags & fpio::O_DEVICE)==0) {
         // Create file if missing
         if ((flags & fpio::O_CREATE)!=0) oflags |= O_CREAT | O_TRUNC;
@@ -71,56 +313,150 @@ flpdisk::flpdisk(const char * file, int flags) {
         this->useDevice=true;
     }
 
+    // Bypass the page cache, so that we always see the media without
+    // flushing the buffer cache of the whole device
+#if defined O_DIRECT
+    if (((flags & O_DIRECTIO) != 0) && ((flags & O_MMAP) == 0)) {
+        oflags |= O_DIRECT;
+        this->useDirect = true;
+    }
+#endif
+
     // Open the file
     this->fd = open(file, oflags, (mode_t)0600);
     if (this->fd<0) {
         this->setError("Unable to open the floppy file", strerror(errno), ERR_IO, ERL_ERROR);
         return;
     }
-    
+
+    // Direct I/O has to be aligned to the logical sector size
+    if (this->useDirect) {
+        struct stat st;
+        int szSector = 0;
+#if defined BLKSSZGET
+        if (this->useDevice && (ioctl(this->fd, BLKSSZGET, &szSector) == 0) && (szSector >= SZ_SECTOR)) this->szAlign = szSector;
+#endif
+#if defined STATX_DIOALIGN
+        struct statx stx;
+        if (!this->useDevice && (statx(this->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0) &&
+            ((stx.stx_mask & STATX_DIOALIGN) != 0) && (stx.stx_dio_offset_align >= SZ_SECTOR)) {
+            this->szAlign = stx.stx_dio_offset_align;
+        } else
+#endif
+        if (!this->useDevice && (fstat(this->fd, &st) == 0) && (st.st_blksize > SZ_SECTOR)) this->szAlign = st.st_blksize;
+    }
+
+    // Find out how big the image is
+    long long fSize = lseek(this->fd, 0, SEEK_END);
+#if defined BLKGETSIZE64
+    unsigned long long szDevice;
+    if (this->useDevice && (ioctl(this->fd, BLKGETSIZE64, &szDevice) == 0)) fSize = szDevice;
+#endif
+
+    // Initialize layout. Clients take it from the superblock, if the
+    // host wrote one.
+    this->layout = layout;
+    bool bSuperblock = false;
+    if (this->isClient && (fSize >= SZ_SECTOR)) {
+        superblock sb;
+        if ((this->rawRead(0, &sb, sizeof(sb)) == sizeof(sb)) && superblockValid(sb)) {
+            this->layout = sb.layout;
+            bSuperblock = true;
+
+            // The host may have moved on to another layout already
+            if ((sb.proposed != 0) && layoutFits(sb.next) && (sb.next.szImage == sb.layout.szImage)) {
+                this->layout = sb.next;
+                this->generation = sb.proposed;
+            }
+        }
+    }
+    if (this->isClient && !bSuperblock && ((layout.options & LO_SUPERBLOCK) != 0)) {
+        this->setError("No valid superblock in the image", ERR_INVALID, ERL_ERROR);
+        return;
+    }
+    if ((this->layout.numSlots < 1) || (this->layout.numSlots > MAX_SLOTS)) {
+        this->setError("Invalid number of slots in disk layout", ERR_INVALID, ERL_ERROR);
+        return;
+    }
+    if ((this->layout.numStreams < 1) || (this->layout.numStreams > MAX_STREAMS) || (this->layout.numSlots % this->layout.numStreams != 0)) {
+        this->setError("Invalid number of streams in disk layout", ERR_INVALID, ERL_ERROR);
+        return;
+    }
+
+    // Rebuild the layout for the size of an existing image. Custom
+    // layouts are rebuilt as if they came from make_layout, with the
+    // same split between the directions.
+    if (((flags & O_AUTOSIZE) != 0) && !bSuperblock && (fSize >= 2*SZ_SECTOR)) {
+        unsigned int szFit = (fSize > SZ_IMAGE_MAX) ? SZ_IMAGE_MAX : (unsigned int)fSize;
+        szFit -= szFit % SZ_SECTOR;
+        if (szFit != this->layout.szImage) {
+            unsigned int pctIn = layout_split(this->layout);
+            if (this->layout.version == LAYOUT_CLASSIC) {
+                this->layout = make_classic_layout(szFit, pctIn);
+            } else {
+                this->layout = make_layout(this->layout.numSlots / this->layout.numStreams, this->layout.options, szFit, pctIn);
+            }
+        }
+    }
+    if (!layoutFits(this->layout)) {
+        this->setError("Disk layout does not fit in the image", ERR_INVALID, ERL_ERROR);
+        return;
+    }
+    if (this->useDirect && !layoutDirect(this->layout, this->szAlign)) {
+        this->setError("Disk layout is not aligned for direct I/O", "Usage error", ERR_INVALID, ERL_ERROR);
+        return;
+    }
+
+    // Without the reset count we could not tell when our copy of the
+    // image went stale
+    if (((flags & O_DELTA) != 0) && ((flags & O_MMAP) == 0) && ((this->layout.options & LO_SUPERBLOCK) == 0)) {
+        this->setError("O_DELTA requires a layout with a superblock", "Usage error", ERR_INVALID, ERL_ERROR);
+        return;
+    }
+
     // Make sure file is long enough
-    int fSize = lseek(this->fd, 0, SEEK_END);
-    if (fSize < SZ_FLOPPY) {
+    if (fSize < this->layout.szImage) {
 
-        // Go to the end
-        lRet=lseek(this->fd, SZ_FLOPPY-1, SEEK_SET);
-        if (lRet == -1) {
+        // Write one byte at the end to stretch it
+        lRet=this->rawWrite(this->layout.szImage-1, "", 1);
+        if (lRet != 1) {
             this->setError("Unable to stretch floppy file",strerror(errno), ERR_IO, ERL_ERROR);
             return;
         }
+    }
 
-        // And write one byte to stretch it
-        lRet=write(this->fd, "", 1);
-        if (lRet != 1) {
-            this->setError("Unable to stretch floppy file",strerror(errno), ERR_IO, ERL_ERROR);
+    // Map the image if requested
+    if ((flags & O_MMAP) != 0) {
+        void * ptr = mmap(NULL, this->layout.szImage, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+        if (ptr == MAP_FAILED) {
+            this->setError("Unable to map memory region",strerror(errno), ERR_IO, ERL_ERROR);
             return;
         }
+        this->map = (char *) ptr;
     }
+    // Clients see the directions swapped
+    this->setLayout(this->layout);
 
-    // Initialize layout
-    this->layout = FPIO_DEFAULT_STRUCTURE;
-    if ((flags & O_CLIENT) != 0) {
-        unsigned int tmp;
+    // Check if we have to reset this file
+    if ((flags & fpio::O_NORESET)==0) this->reset();
 
-        // Swap control byte positions
-        tmp = this->layout.ofsControlOut;
-        this->layout.ofsControlOut = this->layout.ofsControlIn;
-        this->layout.ofsControlIn = tmp;
-        
-        // Swap buffer positions
-        tmp = this->layout.ofsBufferOut;
-        this->layout.ofsBufferOut = this->layout.ofsBufferIn;
-        this->layout.ofsBufferIn = tmp;
+    // Describe the layout to the other end
+    if (!this->isClient && ((this->layout.options & LO_SUPERBLOCK) != 0) && this->ready()) {
+        if (this->writeSuperblock() < 0) return;
+    }
 
-        // Swap buffer sizes
-        tmp = this->layout.szBufferOut;
-        this->layout.szBufferOut = this->layout.szBufferIn;
-        this->layout.szBufferIn = tmp;
-        
+    // Tell the host we follow the layout it switched to
+    if (this->isClient && (this->generation != 0) && this->ready()) {
+        if (this->ioWrite(offsetof(superblock, accepted), &this->generation, sizeof(this->generation), "Unable to write the superblock") < 0) return;
     }
 
-    // Check if we have to reset this file
-    if ((flags & fpio::O_NORESET)==0) this->reset();
+    // Keep a copy of the image to find out what changed. Mapped
+    // images are written by the page anyway.
+    if (((flags & O_DELTA) != 0) && (this->map == NULL) && this->ready()) {
+        this->shadow = new char[this->layout.szImage];
+        this->dirty = new unsigned char[this->layout.szImage / SZ_SECTOR + 1];
+        if (this->loadShadow() < 0) return;
+    }
 
 }
 
@@ -132,15 +468,38 @@ int flpdisk::reset() {
     // Make sure floppy is ready    
     if (!this->ready()) return ERR_NOTREADY;
 
-    // Go to the beginning
-    if (lseek(this->fd, 0, SEEK_SET) == -1)
-        return this->setError("Unable to reset floppy file",strerror(errno), ERR_IO, ERL_ERROR);
+    // Tell the other end that its copy of the image is stale
+    if ((this->layout.options & LO_SUPERBLOCK) != 0) {
+        unsigned int resets;
+        int lRet = this->ioRead(offsetof(superblock, resets), &resets, sizeof(resets), SP_READ_DATA, "Unable to read the superblock");
+        if (lRet < 0) return lRet;
+        resets++;
+        lRet = this->ioWrite(offsetof(superblock, resets), &resets, sizeof(resets), "Unable to write the superblock");
+        if (lRet < 0) return lRet;
+        this->resets = resets;
+    }
+
+    // Zero the mapped image in-place, except for the superblock
+    unsigned int szImage = this->layout.szImage;
+    unsigned int ofsStart = ((this->layout.options & LO_SUPERBLOCK) != 0) ? SZ_SECTOR : 0;
+    if (this->map != NULL) {
+        memset(this->map + ofsStart, 0, szImage - ofsStart);
+        return this->flush(ofsStart, szImage - ofsStart);
+    }
 
-    // Write zeroes
-    char * buf = new char[SZ_FLOPPY+1];
-    memset(buf, 0, SZ_FLOPPY);
-    if (write(this->fd, buf, SZ_FLOPPY) != SZ_FLOPPY)
-        return this->setError("Unable to reset floppy file",strerror(errno), ERR_IO, ERL_ERROR);
+    // Write zeroes, a chunk at a time
+    unsigned int szChunk = (szImage < SZ_RESET_CHUNK) ? szImage : SZ_RESET_CHUNK;
+    char * buf = new char[szChunk];
+    memset(buf, 0, szChunk);
+    for (unsigned int ofs = ofsStart; ofs < szImage; ofs += szChunk) {
+        unsigned int szLen = (szImage - ofs < szChunk) ? szImage - ofs : szChunk;
+        if (this->rawWrite(ofs, buf, szLen) != (int)szLen) {
+            delete[] buf;
+            return this->setError("Unable to reset floppy file",strerror(errno), ERR_IO, ERL_ERROR);
+        }
+    }
+    delete[] buf;
+    if (this->shadow != NULL) memset(this->shadow + ofsStart, 0, szImage - ofsStart);
 
     // Synchronize
     return this->sync();
@@ -159,13 +518,19 @@ int flpdisk::sync() {
     if (!this->ready()) return ERR_NOTREADY;
 
     // Sync changes
+    if (this->stats != NULL) this->stats->syncs++;
+    this->countCall(SC_FSYNC);
     if (fsync(this->fd) == -1)
         return this->setError("Unable to synchronize floppy file",strerror(errno), ERR_IO, ERL_ERROR);
 
-    // Flush buffers
+    // Flush buffers (direct I/O does not go through them)
 #if defined __linux__
-    ioctl(this->fd, FDFLUSH);
-    ioctl(this->fd, BLKFLSBUF);
+    if (!this->useDirect) {
+        this->countCall(SC_IOCTL);
+        ioctl(this->fd, FDFLUSH);
+        this->countCall(SC_IOCTL);
+        ioctl(this->fd, BLKFLSBUF);
+    }
 #endif
 
     // No error
@@ -173,239 +538,684 @@ int flpdisk::sync() {
 
 }
 
-// 
-// A bit more extended ready() function
-//
-bool flpdisk::ready() {
-    if (this->fd<=0) return false;
-    return errorbase::ready();
-};
-
-//
-// FloppyIO Destructor
-//
-flpdisk::~flpdisk() {
-    if (this->error()) return;
-    close(this->fd);
-};
-
 //
-// ==[ I/O Functions ]================================================
+// Flush a range of the image to the backing store
 //
-
+// On a mapped image only the pages that cover the given
+// range are written back. On unmapped images the data
+// of the whole file are synced.
 //
-// Read the INPUT Extended header
-// 
-int flpdisk::get_in_xhdr(extended_header * hdr) {
-
-    // If we are not using extended protocol raise error
-    if (!this->useExtended) return this->setError("You asked for XHDR operations, but you are not using extended protocol", "Usage error", ERR_INVALID, ERL_ERROR);
+int flpdisk::flush(unsigned int ofs, unsigned int szLen) {
 
     // Make sure floppy is ready    
     if (!this->ready()) return ERR_NOTREADY;
 
-    // Seek to the input control byte
-    if (lseek(this->fd, this->layout.ofsBufferIn, SEEK_SET) == -1)
-        return this->setError("Unable to read input extended header",strerror(errno), ERR_IO, ERL_ERROR);
+    // Unmapped files can only be synced as a whole
+    if (this->stats != NULL) this->stats->syncs++;
+    if (this->map == NULL) {
+        this->countCall(SC_FDATASYNC);
+        if (fdatasync(this->fd) == -1)
+            return this->setError("Unable to synchronize floppy file",strerror(errno), ERR_IO, ERL_ERROR);
+        return ERR_NONE;
+    }
 
-    // Try to read input
-    this->sync();
-    if (read(this->fd, hdr->value, SZ_EXTENDED_HEADER) != SZ_EXTENDED_HEADER) 
-        return this->setError("Unable to read input extended header",strerror(errno), ERR_IO, ERL_ERROR);
+    // msync() wants a page-aligned start address
+    static const unsigned int szPage = sysconf(_SC_PAGESIZE);
+    unsigned int ofsStart = ofs - (ofs % szPage);
+    this->countCall(SC_MSYNC);
+    if (this->stats != NULL) this->stats->bytesFlushed += szLen;
+    if (msync(this->map + ofsStart, szLen + (ofs - ofsStart), MS_SYNC) == -1)
+        return this->setError("Unable to flush floppy region",strerror(errno), ERR_IO, ERL_ERROR);
 
     // No error
     return ERR_NONE;
+
 }
 
 //
-// Read the OUTPUT Extended header
-// 
-int flpdisk::get_out_xhdr(extended_header * hdr) {
-
-    // If we are not using extended protocol raise error
-    if (!this->useExtended) return this->setError("You asked for XHDR operations, but you are not using extended protocol", "Usage error", ERR_INVALID, ERL_ERROR);
+// Invalidate a range of the image
+//
+// Makes sure that the next access to the given range
+// observes the changes made by the other end.
+//
+int flpdisk::invalidate(unsigned int ofs, unsigned int szLen) {
 
     // Make sure floppy is ready    
     if (!this->ready()) return ERR_NOTREADY;
 
-    // Seek to the input control byte
-    if (lseek(this->fd, this->layout.ofsBufferOut, SEEK_SET) == -1)
-        return this->setError("Unable to read input extended header",strerror(errno), ERR_IO, ERL_ERROR);
+    // Regular files share the page cache with the other end,
+    // so only mapped regions have something to invalidate
+    if (this->stats != NULL) this->stats->syncs++;
+    if (this->map != NULL) {
+        // msync() wants a page-aligned start address
+        static const unsigned int szPage = sysconf(_SC_PAGESIZE);
+        unsigned int ofsStart = ofs - (ofs % szPage);
+        this->countCall(SC_MSYNC);
+        if (msync(this->map + ofsStart, szLen + (ofs - ofsStart), MS_INVALIDATE) == -1)
+            return this->setError("Unable to invalidate floppy region",strerror(errno), ERR_IO, ERL_ERROR);
+    }
 
-    // Try to read input
-    this->sync();
-    if (read(this->fd, hdr->value, SZ_EXTENDED_HEADER) != SZ_EXTENDED_HEADER) 
-        return this->setError("Unable to read input extended header",strerror(errno), ERR_IO, ERL_ERROR);
+    // Block devices keep their own buffer cache
+#if defined __linux__
+    if (this->useDevice && !this->useDirect) {
+        this->countCall(SC_IOCTL);
+        ioctl(this->fd, FDFLUSH);
+        this->countCall(SC_IOCTL);
+        ioctl(this->fd, BLKFLSBUF);
+    }
+#endif
 
     // No error
     return ERR_NONE;
+
 }
 
 //
-// Write the INPUT Extended header
-// 
-int flpdisk::set_in_xhdr(extended_header * hdr) {
+// Synchronize at the given point according to the sync policy
+//
+// The policy decides which points need a cache invalidation (before
+// reads) or a flush (after writes). Under SYNC_PER_OPERATION unmapped
+// images keep the historical full sync() at every point. Otherwise
+// unmapped writes need no flush: the durable policies open the image
+// with O_SYNC, so a write is on the media when it returns.
+//
+int flpdisk::syncAt(int point, unsigned int ofs, unsigned int szLen) {
+    bool bRead = (point == SP_READ_CONTROL) || (point == SP_READ_DATA);
 
-    // If we are not using extended protocol raise error
-    if (!this->useExtended) return this->setError("You asked for XHDR operations, but you are not using extended protocol", "Usage error", ERR_INVALID, ERL_ERROR);
+    switch (this->syncPolicy) {
+        case SYNC_PER_OPERATION:
+            if (this->map == NULL) return this->sync();
+            break;
 
-    // Make sure floppy is ready    
-    if (!this->ready()) return ERR_NOTREADY;
+        case SYNC_PER_COMMIT:
+            if (point == SP_READ_DATA) return ERR_NONE;
+            break;
 
-    // Seek to the input control byte
-    if (lseek(this->fd, this->layout.ofsBufferIn, SEEK_SET) == -1)
-        return this->setError("Unable to write input extended header",strerror(errno), ERR_IO, ERL_ERROR);
+        case SYNC_READ_INVALIDATE:
+            if (point != SP_READ_CONTROL) return ERR_NONE;
+            break;
 
-    // Try to read input
-    this->sync();
-    if (write(this->fd, hdr->value, SZ_EXTENDED_HEADER) != SZ_EXTENDED_HEADER) 
-        return this->setError("Unable to write input extended header",strerror(errno), ERR_IO, ERL_ERROR);
+        default:
+            return ERR_NONE;
+    }
 
-    // No error
-    return ERR_NONE;
+    if (!bRead && (this->map == NULL)) return ERR_NONE;
+    return bRead ? this->invalidate(ofs, szLen) : this->flush(ofs, szLen);
 }
 
 //
-// Write the OUTPUT Extended header
-// 
-int flpdisk::set_out_xhdr(extended_header * hdr) {
-
-    // If we are not using extended protocol raise error
-    if (!this->useExtended) return this->setError("You asked for XHDR operations, but you are not using extended protocol", "Usage error", ERR_INVALID, ERL_ERROR);
+// Start or stop keeping counters
+//
+// The counters live as long as the instance, so other threads may
+// keep reading what getStats() gave them after counting stopped.
+// Starting again clears them.
+//
+void flpdisk::enableStats(bool state) {
+    if (state && (this->stats == NULL)) {
+        if (this->statsStore == NULL) this->statsStore = new io_stats;
+        this->statsStore->clear();
+        this->stats = this->statsStore;
+    } else if (!state) {
+        this->stats = NULL;
+    }
+}
 
-    // Make sure floppy is ready    
-    if (!this->ready()) return ERR_NOTREADY;
+//
+// The counters, or NULL if they are not kept
+//
+io_stats * flpdisk::getStats() {
+    return this->stats;
+}
 
-    // Seek to the input control byte
-    if (lseek(this->fd, this->layout.ofsBufferOut, SEEK_SET) == -1)
-        return this->setError("Unable to read input extended header",strerror(errno), ERR_IO, ERL_ERROR);
+//
+// Start or stop recording trace events
+//
+// The ring keeps the last 'capacity' events. Do not change this while
+// other threads use the instance.
+//
+void flpdisk::enableTrace(bool state, unsigned int capacity) {
+    if (this->tracer != NULL) {
+        delete this->tracer;
+        this->tracer = NULL;
+    }
+    if (state) this->tracer = new trace_ring(capacity);
+}
 
-    // Try to read input
-    this->sync();
-    if (write(this->fd, hdr->value, SZ_EXTENDED_HEADER) != SZ_EXTENDED_HEADER) 
-        return this->setError("Unable to read input extended header",strerror(errno), ERR_IO, ERL_ERROR);
+//
+// The trace ring, or NULL if we are not tracing
+//
+trace_ring * flpdisk::getTrace() {
+    return this->tracer;
+}
 
-    // No error
+//
+// Write the recorded events to a Chrome trace (JSON) file
+//
+int flpdisk::dumpTrace(const char * file) {
+    if (this->tracer == NULL)
+        return this->setError("Tracing is not enabled", "Usage error", ERR_INVALID, ERL_ERROR);
+
+    FILE * f = fopen(file, "w");
+    if (f == NULL)
+        return this->setError("Unable to write the trace file", strerror(errno), ERR_IO, ERL_ERROR);
+    string trace = this->tracer->json();
+    size_t szWritten = fwrite(trace.data(), 1, trace.size(), f);
+    if ((fclose(f) != 0) || (szWritten != trace.size()))
+        return this->setError("Unable to write the trace file", strerror(errno), ERR_IO, ERL_ERROR);
     return ERR_NONE;
 }
 
 //
-// Read the INPUT Control byte
-// 
-int flpdisk::get_in_cb(ctrlbyte * cb) {
-
-    // Make sure floppy is ready    
-    if (!this->ready()) return ERR_NOTREADY;
+// Record an instant event
+//
+void flpdisk::traceEvent(int type, int streamID, int slot, int size) {
+    if (this->tracer != NULL) this->tracer->event(type, TP_INSTANT, streamID, slot, size);
+}
 
-    // Seek to the input control byte
-    if (lseek(this->fd, this->layout.ofsControlIn, SEEK_SET) == -1)
-        return this->setError("Unable to read input control byte",strerror(errno), ERR_IO, ERL_ERROR);
+//
+// Count a system call
+//
+void flpdisk::countCall(int type) {
+    if (this->stats != NULL) this->stats->syscalls[type]++;
+}
 
-    // Try to read input
-    this->sync();
-    if (read(this->fd, &cb->value, 1) != 1) 
-        return this->setError("Unable to read input control byte",strerror(errno), ERR_IO, ERL_ERROR);
+// 
+// A bit more extended ready() function
+//
+bool flpdisk::ready() {
+    if (this->fd<=0) return false;
+    return errorbase::ready();
+};
 
-    // No error
-    return ERR_NONE;
+//
+// The size of the image, as given by the layout
+//
+unsigned int flpdisk::imageSize() {
+    return this->layout.szImage;
 }
 
 //
-// Read the OUTPUT Control byte
-// 
-int flpdisk::get_out_cb(ctrlbyte * cb) {
+// ==[ Superblock and capability negotiation ]=========================
+//
 
-    // Make sure floppy is ready    
-    if (!this->ready()) return ERR_NOTREADY;
+//
+// Write the superblock of a LO_SUPERBLOCK layout
+//
+// Done by the host when it opens the image. Nobody has offered any
+// capabilities yet.
+//
+int flpdisk::writeSuperblock() {
+    superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = SB_MAGIC;
+    sb.version = SB_VERSION;
+    sb.layout = this->layout;
+    sb.checksum = crc32c(0, &sb, offsetof(superblock, checksum));
+
+    // The reset count outlives the superblock
+    int lRet = this->ioRead(offsetof(superblock, resets), &sb.resets, sizeof(sb.resets), SP_READ_DATA, "Unable to read the superblock");
+    if (lRet < 0) return lRet;
+
+    lRet = this->ioWrite(0, &sb, sizeof(sb), "Unable to write the superblock");
+    if (lRet < 0) return lRet;
+    return this->syncAt(SP_WRITE, 0, sizeof(sb));
+}
 
-    // Seek to the input control byte
-    if (lseek(this->fd, this->layout.ofsControlOut, SEEK_SET) == -1)
-        return this->setError("Unable to read output control byte",strerror(errno), ERR_IO, ERL_ERROR);
+//
+// The capabilities this end offers
+//
+int flpdisk::localCaps() {
+    return CAP_RING | CAP_INLINE | (this->useExtended ? CAP_EXTENDED : 0);
+}
 
-    // Try to read input
-    this->sync();
-    if (read(this->fd, &cb->value, 1) != 1) 
-        return this->setError("Unable to read output control byte",strerror(errno), ERR_IO, ERL_ERROR);
+//
+// Stop using what the other end does not support
+//
+void flpdisk::applyCaps(int caps) {
+    if ((caps & CAP_EXTENDED) == 0) this->useExtended = false;
+    this->useInline = ((caps & CAP_INLINE) != 0);
+}
 
-    // No error
+//
+// Write our capabilities into the superblock, once
+//
+int flpdisk::publishCaps() {
+    if (this->capsPublished) return ERR_NONE;
+    if ((this->layout.options & LO_SUPERBLOCK) == 0)
+        return this->setError("The layout has no superblock", "Usage error", ERR_INVALID, ERL_ERROR);
+
+    unsigned int value = this->localCaps() | CAP_PUBLISHED;
+    unsigned int ofs = this->isClient ? offsetof(superblock, capsClient) : offsetof(superblock, capsHost);
+    int lRet = this->ioWrite(ofs, &value, sizeof(value), "Unable to write the superblock");
+    if (lRet < 0) return lRet;
+    lRet = this->syncAt(SP_WRITE, ofs, sizeof(value));
+    if (lRet < 0) return lRet;
+
+    this->capsPublished = true;
     return ERR_NONE;
 }
 
 //
-// Write the INPUT Control byte
-// 
-int flpdisk::set_in_cb(ctrlbyte * cb) {
-
-    // Make sure floppy is ready    
+// Agree with the other end on the capabilities to use
+//
+// Offers ours in the superblock, waits up to timeout milliseconds
+// (0 = forever) for the other end to offer its own, and from then
+// on only uses what both ends offered. Until then the flags given
+// at open time are used as they are.
+//
+// Clients negotiate when they open the image. The host publishes
+// its offer at open time, and settles on the common capabilities by
+// itself once the client offered its own (see settleCaps). Calling
+// this on the host waits for the client instead.
+// The client only writes its offer after it saw the one of the host,
+// so the two ends never write the superblock at the same time.
+//
+int flpdisk::negotiate(int timeout) {
     if (!this->ready()) return ERR_NOTREADY;
+    int lRet = ERR_NONE;
+    if (!this->isClient) lRet = this->publishCaps();
+    if (lRet < 0) return lRet;
+
+    // Wait for the offer of the other end
+    unsigned int ofsPeer = this->isClient ? offsetof(superblock, capsHost) : offsetof(superblock, capsClient);
+    unsigned int peer;
+    lRet = this->waitSuperblock(ofsPeer, 0, timeout, &peer);
+    if (lRet == ERR_TIMEOUT)
+        return this->setError("Timeout while waiting for the other end to negotiate", ERR_TIMEOUT, ERL_ERROR);
+    if (lRet < 0) return lRet;
+    if (this->isClient) lRet = this->publishCaps();
+    if (lRet < 0) return lRet;
+    return this->adoptCaps(peer);
+}
 
-    // Seek to the input control byte
-    if (lseek(this->fd, this->layout.ofsControlIn, SEEK_SET) == -1)
-        return this->setError("Unable to write input control byte",strerror(errno), ERR_IO, ERL_ERROR);
-
-    // Try to read input
-    this->sync();
-    if (write(this->fd, &cb->value, 1) != 1) 
-        return this->setError("Unable to write input control byte",strerror(errno), ERR_IO, ERL_ERROR);
-
-    // No error
+//
+// Keep what we have in common with the offer of the other end
+//
+int flpdisk::adoptCaps(unsigned int peer) {
+    int common = this->localCaps() & (int)peer & ~CAP_PUBLISHED;
+    if ((this->layout.numSlots > 1) && ((common & CAP_RING) == 0))
+        return this->setError("The other end does not support ring layouts", ERR_INVALID, ERL_ERROR);
+    this->applyCaps(common);
+    this->caps = common;
     return ERR_NONE;
 }
 
 //
-// Write the OUTPUT Control byte
-// 
-int flpdisk::set_out_cb(ctrlbyte * cb) {
-
-    // Make sure floppy is ready    
-    if (!this->ready()) return ERR_NOTREADY;
-
-    // Seek to the input control byte
-    if (lseek(this->fd, this->layout.ofsControlOut, SEEK_SET) == -1)
-        return this->setError("Unable to write output control byte",strerror(errno), ERR_IO, ERL_ERROR);
-
-    // Try to read input
-    this->sync();
-    if (write(this->fd, &cb->value, 1) != 1) 
-        return this->setError("Unable to write output control byte",strerror(errno), ERR_IO, ERL_ERROR);
+// Pick up the offer of the client once it made one (host side)
+//
+// The host publishes its offer when it opens the image, before the
+// client is there, so it cannot wait for the answer. Instead it looks
+// for it before each message, until it finds it, and from then on
+// uses what both ends offered, as if it had called negotiate.
+//
+int flpdisk::settleCaps() {
+    if ((this->caps >= 0) || this->isClient || !this->capsPublished) return ERR_NONE;
+
+    unsigned int peer;
+    int lRet = this->ioRead(offsetof(superblock, capsClient), &peer, sizeof(peer), SP_READ_CONTROL, "Unable to read the superblock");
+    if (lRet < 0) return lRet;
+    if (peer == 0) return ERR_NONE;
+    return this->adoptCaps(peer);
+}
 
-    // No error
-    return ERR_NONE;
+//
+// Wait up to timeout milliseconds (0 = forever) until a field of
+// the superblock is no longer 'value'
+//
+int flpdisk::waitSuperblock(unsigned int ofs, unsigned int value, int timeout, unsigned int * result) {
+    unsigned long long tExpired = (timeout > 0) ? monotonic_time() + (unsigned long long)timeout * 1000 : 0;
+    for (;;) {
+        int lRet = this->ioRead(ofs, result, sizeof(*result), SP_READ_CONTROL, "Unable to read the superblock");
+        if (lRet < 0) return lRet;
+        if (*result != value) return ERR_NONE;
+        if ((tExpired != 0) && (monotonic_time() >= tExpired)) return ERR_TIMEOUT;
+        usleep(1000);
+    }
 }
 
 //
-// Read the input buffer
+// Start using a layout, given as seen from the host
 //
-int flpdisk::read_in(char * buffer, int szLen) {
+void flpdisk::setLayout(const disk_layout & hostView) {
+    disk_layout view = hostView;
+    if (this->isClient) swapDirections(view);
+    this->layout = view;
+
+    // Frames fetched on the old layout are gone
+    if (((view.options & LO_ALIGNED) != 0) && (this->inFrames == NULL)) this->inFrames = new char[MAX_SLOTS * SZ_SECTOR];
+    memset(this->inFrameValid, 0, sizeof(this->inFrameValid));
+}
 
-    // Make sure floppy is ready    
-    if (!this->ready()) return ERR_NOTREADY;
+//
+// Called when the layout changed under a derived class
+//
+void flpdisk::layoutChanged() {
+}
 
-    // Prevent overflow
-    if (szLen > this->layout.szBufferIn)
-        szLen = this->layout.szBufferIn;
+//
+// Switch both ends to another layout (host side)
+//
+// Only at a quiescent point: nothing may be in flight in either
+// direction, and the client has to be in acceptLayout. The data
+// area is cleared, the new layout is published in the superblock
+// and used from now on. We then wait up to timeout milliseconds for
+// the client to confirm that it switched too.
+//
+int flpdisk::proposeLayout(const disk_layout & next, int timeout) {
+    if (!this->ready()) return ERR_NOTREADY;
+    if (this->isClient || ((this->layout.options & LO_SUPERBLOCK) == 0))
+        return this->setError("Only the host of a layout with a superblock can change it", "Usage error", ERR_INVALID, ERL_ERROR);
+    if (!layoutFits(next) || (next.szImage != this->layout.szImage) || ((next.options & LO_SUPERBLOCK) == 0))
+        return this->setError("The new layout does not fit in the image", ERR_INVALID, ERL_ERROR);
+    if (this->useDirect && !layoutDirect(next, this->szAlign))
+        return this->setError("The new layout is not aligned for direct I/O", "Usage error", ERR_INVALID, ERL_ERROR);
+
+    // Clear the slots of the old layout, so that the new one starts empty
+    int lRet = this->reset();
+    if (lRet < 0) return lRet;
+
+    // Publish the layout, then its generation
+    unsigned int gen = this->generation + 1;
+    lRet = this->ioWrite(offsetof(superblock, next), &next, sizeof(next), "Unable to write the superblock");
+    if (lRet < 0) return lRet;
+    lRet = this->syncAt(SP_COMMIT, offsetof(superblock, next), sizeof(next));
+    if (lRet < 0) return lRet;
+    lRet = this->ioWrite(offsetof(superblock, proposed), &gen, sizeof(gen), "Unable to write the superblock");
+    if (lRet < 0) return lRet;
+    lRet = this->syncAt(SP_WRITE, offsetof(superblock, proposed), sizeof(gen));
+    if (lRet < 0) return lRet;
+
+    this->generation = gen;
+    this->setLayout(next);
+    this->layoutChanged();
+
+    // Wait for the client to follow
+    unsigned int accepted;
+    lRet = this->waitSuperblock(offsetof(superblock, accepted), gen - 1, timeout, &accepted);
+    if (lRet == ERR_TIMEOUT)
+        return this->setError("Timeout while waiting for the other end to change the layout", ERR_TIMEOUT, ERL_ERROR);
+    return (lRet < 0) ? lRet : ERR_NONE;
+}
 
-    // If we are using extended version, skip extended header
-    int szOffset = this->layout.ofsBufferIn;
-    if (this->useExtended) {
+//
+// Switch to the layout the host proposed (client side)
+//
+// Waits up to timeout milliseconds for a new layout, starts using it
+// and confirms it to the host.
+//
+int flpdisk::acceptLayout(int timeout) {
+    if (!this->ready()) return ERR_NOTREADY;
+    if (!this->isClient || ((this->layout.options & LO_SUPERBLOCK) == 0))
+        return this->setError("Only the client of a layout with a superblock can accept a new one", "Usage error", ERR_INVALID, ERL_ERROR);
+
+    unsigned int gen;
+    int lRet = this->waitSuperblock(offsetof(superblock, proposed), this->generation, timeout, &gen);
+    if (lRet == ERR_TIMEOUT)
+        return this->setError("Timeout while waiting for the other end to change the layout", ERR_TIMEOUT, ERL_ERROR);
+    if (lRet < 0) return lRet;
+
+    disk_layout next;
+    lRet = this->ioRead(offsetof(superblock, next), &next, sizeof(next), SP_READ_DATA, "Unable to read the superblock");
+    if (lRet < 0) return lRet;
+    if (!layoutFits(next) || (next.szImage != this->layout.szImage) || ((next.options & LO_SUPERBLOCK) == 0))
+        return this->setError("The proposed layout does not fit in the image", ERR_INPUT, ERL_ERROR);
+    if (this->useDirect && !layoutDirect(next, this->szAlign))
+        return this->setError("The proposed layout is not aligned for direct I/O", ERR_INPUT, ERL_ERROR);
+
+    // The host cleared the image, our copy is stale
+    if (this->shadow != NULL) {
+        lRet = this->loadShadow();
+        if (lRet < 0) return lRet;
+    }
+
+    this->generation = gen;
+    this->setLayout(next);
+    this->layoutChanged();
+
+    lRet = this->ioWrite(offsetof(superblock, accepted), &gen, sizeof(gen), "Unable to write the superblock");
+    if (lRet < 0) return lRet;
+    lRet = this->syncAt(SP_WRITE, offsetof(superblock, accepted), sizeof(gen));
+    return (lRet < 0) ? lRet : ERR_NONE;
+}
 
-        // Check for overflow if we shift the output
-        if (szLen + SZ_EXTENDED_HEADER > this->layout.szBufferIn)
-            szLen = this->layout.szBufferIn-SZ_EXTENDED_HEADER;
+//
+// FloppyIO Destructor
+//
+flpdisk::~flpdisk() {
+    if (this->map != NULL) munmap(this->map, this->layout.szImage);
+    if (this->shadow != NULL) delete[] this->shadow;
+    if (this->dirty != NULL) delete[] this->dirty;
+    if (this->inFrames != NULL) delete[] this->inFrames;
+    for (size_t i=0; i<this->bouncePool.size(); i++) free(this->bouncePool[i].data);
+    if (this->statsStore != NULL) delete this->statsStore;
+    if (this->tracer != NULL) delete this->tracer;
+    if (this->fd > 0) close(this->fd);
+};
 
-        // Seek a bit further
-        szOffset += SZ_EXTENDED_HEADER;
-        
+//
+// Keep the first szLen bytes of a scatter/gather list
+//
+// @return  The number of pieces in the clipped list
+//
+static int clipIov(const struct iovec * iov, int iovcnt, int szLen, struct iovec * out) {
+    int n = 0;
+    for (int i=0; (i<iovcnt) && (szLen>0); i++) {
+        out[n] = iov[i];
+        if ((int)out[n].iov_len > szLen) out[n].iov_len = szLen;
+        szLen -= out[n].iov_len;
+        n++;
+    }
+    return n;
+}
+
+//
+// ==[ Direct I/O ]===================================================
+//
+
+//
+// Positional read, through the bounce buffer on direct I/O
+//
+// @return  The bytes read or -1 (errno is set)
+//
+int flpdisk::rawRead(unsigned int ofs, void * buffer, unsigned int szLen) {
+    struct iovec iov;
+    if (!this->useDirect) {
+        this->countCall(SC_PREAD);
+        return pread(this->fd, buffer, szLen, ofs);
+    }
+    iov.iov_base = buffer;
+    iov.iov_len = szLen;
+    return this->directReadv(ofs, &iov, 1);
+}
+
+//
+// Positional write, through the bounce buffer on direct I/O
+//
+// @return  The bytes written or -1 (errno is set)
+//
+int flpdisk::rawWrite(unsigned int ofs, const void * buffer, unsigned int szLen) {
+    struct iovec iov;
+    if (!this->useDirect) {
+        this->countCall(SC_PWRITE);
+        return pwrite(this->fd, buffer, szLen, ofs);
     }
+    iov.iov_base = (void *) buffer;
+    iov.iov_len = szLen;
+    return this->directWritev(ofs, &iov, 1);
+}
 
-    // Seek to the input control byte
-    if (lseek(this->fd, szOffset, SEEK_SET) == -1)
-        return this->setError("Unable to read input buffer",strerror(errno), ERR_IO, ERL_ERROR);
+//
+// Take an aligned buffer of at least szLen bytes from the pool
+//
+// Threads working on different slots do direct I/O at the same time,
+// so each takes a buffer of its own and gives it back when done. A
+// buffer that is too small is dropped, so the pool never holds more
+// buffers than there were threads.
+//
+// @return  The buffer (its size goes to szBuffer), or NULL
+//
+char * flpdisk::acquireBounce(unsigned int szLen, unsigned int * szBuffer) {
+    bounce_buffer buf;
+    buf.data = NULL;
+    {
+        lock_guard<mutex> lock(this->bounceLock);
+        if (!this->bouncePool.empty()) {
+            buf = this->bouncePool.back();
+            this->bouncePool.pop_back();
+        }
+    }
+    if ((buf.data != NULL) && (buf.size >= szLen)) {
+        *szBuffer = buf.size;
+        return buf.data;
+    }
+    if (buf.data != NULL) free(buf.data);
+
+    void * ptr;
+    if (posix_memalign(&ptr, this->szAlign, szLen) != 0) return NULL;
+    *szBuffer = szLen;
+    return (char *) ptr;
+}
+
+//
+// Give a buffer back to the pool
+//
+void flpdisk::releaseBounce(char * buffer, unsigned int szBuffer) {
+    bounce_buffer buf;
+    buf.data = buffer;
+    buf.size = szBuffer;
+    lock_guard<mutex> lock(this->bounceLock);
+    this->bouncePool.push_back(buf);
+}
+
+//
+// Read the sectors covering a region, and scatter the region
+//
+int flpdisk::directReadv(unsigned int ofs, const struct iovec * iov, int iovcnt) {
+    unsigned int szLen = 0;
+    for (int i=0; i<iovcnt; i++) szLen += iov[i].iov_len;
+
+    unsigned int ofsStart = ofs - (ofs % this->szAlign);
+    unsigned int ofsEnd = ((ofs + szLen + this->szAlign - 1) / this->szAlign) * this->szAlign;
+    unsigned int szBuffer;
+    char * buf = this->acquireBounce(ofsEnd - ofsStart, &szBuffer);
+    if (buf == NULL) { errno = ENOMEM; return -1; }
+
+    this->countCall(SC_PREAD);
+    int lRet = pread(this->fd, buf, ofsEnd - ofsStart, ofsStart);
+    if ((lRet >= 0) && ((unsigned int)lRet < ofs + szLen - ofsStart)) { errno = EIO; lRet = -1; }
+    if (lRet >= 0) {
+        const char * src = buf + (ofs - ofsStart);
+        for (int i=0; i<iovcnt; i++) {
+            memcpy(iov[i].iov_base, src, iov[i].iov_len);
+            src += iov[i].iov_len;
+        }
+        lRet = szLen;
+    }
+
+    this->releaseBounce(buf, szBuffer);
+    return lRet;
+}
+
+//
+// Gather a region into the sectors covering it, and write them
+//
+// Sectors only partly covered by the region are read first, so the
+// bytes around it are written back as they were. This is not atomic:
+// if the other end writes to the same sector in between, its update
+// is lost. That is why O_DIRECTIO is only accepted on layouts that
+// give each slot blocks of its own (see layoutDirect).
+//
+int flpdisk::directWritev(unsigned int ofs, const struct iovec * iov, int iovcnt) {
+    unsigned int szLen = 0;
+    for (int i=0; i<iovcnt; i++) szLen += iov[i].iov_len;
+    if (szLen == 0) return 0;
+
+    unsigned int ofsStart = ofs - (ofs % this->szAlign);
+    unsigned int ofsEnd = ((ofs + szLen + this->szAlign - 1) / this->szAlign) * this->szAlign;
+    unsigned int ofsLast = ofsEnd - this->szAlign;
+    unsigned int szBuffer;
+    char * buf = this->acquireBounce(ofsEnd - ofsStart, &szBuffer);
+    if (buf == NULL) { errno = ENOMEM; return -1; }
+    int lRet = szLen;
+
+    // Read-modify-write the partial sectors at the edges
+    // (short reads past the end of a file read as zeroes)
+    if (ofs != ofsStart) {
+        this->countCall(SC_PREAD);
+        memset(buf, 0, this->szAlign);
+        if (pread(this->fd, buf, this->szAlign, ofsStart) < 0) lRet = -1;
+    }
+    if ((lRet >= 0) && (ofs + szLen != ofsEnd) && ((ofsLast != ofsStart) || (ofs == ofsStart))) {
+        this->countCall(SC_PREAD);
+        memset(buf + (ofsLast - ofsStart), 0, this->szAlign);
+        if (pread(this->fd, buf + (ofsLast - ofsStart), this->szAlign, ofsLast) < 0) lRet = -1;
+    }
+
+    if (lRet >= 0) {
+        char * dst = buf + (ofs - ofsStart);
+        for (int i=0; i<iovcnt; i++) {
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+
+        this->countCall(SC_PWRITE);
+        if (pwrite(this->fd, buf, ofsEnd - ofsStart, ofsStart) != (int)(ofsEnd - ofsStart)) lRet = -1;
+    }
+
+    this->releaseBounce(buf, szBuffer);
+    return lRet;
+}
+
+//
+// Check if two regions differ, 64 bytes at a time
+//
+static bool regionDiffers(const char * a, const char * b, unsigned int szLen) {
+#if defined __SSE2__
+    while (szLen >= 64) {
+        __m128i d0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a),        _mm_loadu_si128((const __m128i *)b));
+        __m128i d1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 16)), _mm_loadu_si128((const __m128i *)(b + 16)));
+        __m128i d2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 32)), _mm_loadu_si128((const __m128i *)(b + 32)));
+        __m128i d3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 48)), _mm_loadu_si128((const __m128i *)(b + 48)));
+        __m128i eq = _mm_and_si128(_mm_and_si128(d0, d1), _mm_and_si128(d2, d3));
+        if (_mm_movemask_epi8(eq) != 0xFFFF) return true;
+        a += 64;
+        b += 64;
+        szLen -= 64;
+    }
+#endif
+    return memcmp(a, b, szLen) != 0;
+}
+
+//
+// ==[ Raw I/O ]======================================================
+//
+
+//
+// Read a region of the image
+//
+// The sync policy decides what to invalidate before reading. Mapped
+// images are then read straight from memory, otherwise we use
+// positional I/O, so there is no shared file offset between callers.
+//
+int flpdisk::ioRead(unsigned int ofs, void * buffer, unsigned int szLen, int point, const char * what) {
+
+    // Make sure floppy is ready    
+    if (!this->ready()) return ERR_NOTREADY;
+
+    // Make the changes of the other end visible
+    int lRet = this->syncAt(point, ofs, szLen);
+    if (lRet < 0) return lRet;
+    if (this->stats != NULL) this->stats->bytesIn += szLen;
+
+    // Memory-mapped I/O
+    if (this->map != NULL) {
+        memcpy(buffer, this->map + ofs, szLen);
+        return szLen;
+    }
 
     // Try to read input
-    this->sync();
-    if (read(this->fd, buffer, szLen) != szLen) 
-        return this->setError("Unable to read input buffer",strerror(errno), ERR_IO, ERL_ERROR);
+    if (this->rawRead(ofs, buffer, szLen) != (int)szLen) 
+        return this->setError(what,strerror(errno), ERR_IO, ERL_ERROR);
 
     // No error = the size of the data read
     return szLen;
@@ -413,120 +1223,675 @@ int flpdisk::read_in(char * buffer, int szLen) {
 }
 
 //
-// Read the out buffer
+// Read a region of the image into several buffers
 //
-int flpdisk::read_out(char * buffer, int szLen) {
+int flpdisk::ioReadv(unsigned int ofs, const struct iovec * iov, int iovcnt, int point, const char * what) {
+    int szLen = 0;
 
     // Make sure floppy is ready    
     if (!this->ready()) return ERR_NOTREADY;
+    for (int i=0; i<iovcnt; i++) szLen += iov[i].iov_len;
+
+    // Make the changes of the other end visible
+    int lRet = this->syncAt(point, ofs, szLen);
+    if (lRet < 0) return lRet;
+    if (this->stats != NULL) this->stats->bytesIn += szLen;
+
+    // Memory-mapped I/O: Scatter from the map
+    if (this->map != NULL) {
+        const char * src = this->map + ofs;
+        for (int i=0; i<iovcnt; i++) {
+            memcpy(iov[i].iov_base, src, iov[i].iov_len);
+            src += iov[i].iov_len;
+        }
+        return szLen;
+    }
 
-    // Prevent overflow
-    if (szLen > this->layout.szBufferOut)
-        szLen = this->layout.szBufferOut;
+    // Positional vectored read
+    if (!this->useDirect) this->countCall(SC_PREADV);
+    if ((this->useDirect ? this->directReadv(ofs, iov, iovcnt) : preadv(this->fd, iov, iovcnt, ofs)) != szLen)
+        return this->setError(what,strerror(errno), ERR_IO, ERL_ERROR);
 
-    // If we are using extended version, skip extended header
-    int szOffset = this->layout.ofsBufferOut;
-    if (this->useExtended) {
+    // No error = the size of the data read
+    return szLen;
+
+}
 
-        // Check for overflow if we shift the output
-        if (szLen + SZ_EXTENDED_HEADER > this->layout.szBufferOut)
-            szLen = this->layout.szBufferOut-SZ_EXTENDED_HEADER;
+//
+// Write a region of the image from several buffers, skipping the
+// sectors that did not change since we last wrote them
+//
+// The new data is compared against the shadow copy sector by sector,
+// and every run of changed sectors is written with one call. Runs are
+// clipped to the region, so the bytes around it (like control bytes
+// the other end writes) are never overwritten with our stale copy.
+//
+// The first sector, with the header of a message, is always written.
+// The copy is read again after the other end reset the image, which
+// the reset count in the superblock tells (O_DELTA needs one).
+//
+int flpdisk::deltaWritev(unsigned int ofs, const struct iovec * iov, int iovcnt, const char * what) {
+    unsigned char * dirty = this->dirty;
+    unsigned int pos = ofs, first = ofs / SZ_SECTOR, last, end = ofs;
+    int lRet;
 
-        // Seek a bit further
-        szOffset += SZ_EXTENDED_HEADER;
-        
+    // Start over from the image if it was reset under us
+    if ((this->layout.options & LO_SUPERBLOCK) != 0) {
+        unsigned int resets;
+        if (this->rawRead(offsetof(superblock, resets), &resets, sizeof(resets)) != (int)sizeof(resets))
+            return this->setError(what, strerror(errno), ERR_IO, ERL_ERROR);
+        if ((resets != this->resets) && ((lRet = this->loadShadow()) < 0)) return lRet;
     }
 
-    // Seek to the input control byte
-    if (lseek(this->fd, szOffset, SEEK_SET) == -1)
-        return this->setError("Unable to read output buffer",strerror(errno), ERR_IO, ERL_ERROR);
+    // Compare and keep the new data
+    for (int i=0; i<iovcnt; i++) end += iov[i].iov_len;
+    if (end == ofs) return 0;
+    memset(dirty, 0, (end - 1) / SZ_SECTOR - first + 1);
+    dirty[0] = 1;
+    for (int i=0; i<iovcnt; i++) {
+        const char * src = (const char *) iov[i].iov_base;
+        unsigned int szLeft = iov[i].iov_len;
+        while (szLeft > 0) {
+            unsigned int szChunk = SZ_SECTOR - (pos % SZ_SECTOR);
+            if (szChunk > szLeft) szChunk = szLeft;
+            if (regionDiffers(this->shadow + pos, src, szChunk)) {
+                dirty[pos / SZ_SECTOR - first] = 1;
+                memcpy(this->shadow + pos, src, szChunk);
+            }
+            pos += szChunk;
+            src += szChunk;
+            szLeft -= szChunk;
+        }
+    }
+    last = (end - 1) / SZ_SECTOR;
+
+    // Write the runs of changed sectors
+    for (unsigned int s = first; s <= last; ) {
+        if (!dirty[s - first]) { s++; continue; }
+        unsigned int e = s;
+        while ((e < last) && dirty[e + 1 - first]) e++;
+
+        unsigned int runStart = s * SZ_SECTOR, runEnd = (e + 1) * SZ_SECTOR;
+        if (runStart < ofs) runStart = ofs;
+        if (runEnd > end) runEnd = end;
+        if (this->rawWrite(runStart, this->shadow + runStart, runEnd - runStart) != (int)(runEnd - runStart)) {
+            // We no longer know what is on the disk, write everything from now on
+            int err = errno;
+            delete[] this->shadow;
+            this->shadow = NULL;
+            return this->setError(what,strerror(err), ERR_IO, ERL_ERROR);
+        }
+        s = e + 1;
+    }
 
-    // Try to read input
-    this->sync();
-    if (read(this->fd, buffer, szLen) != szLen) 
-        return this->setError("Unable to read output buffer",strerror(errno), ERR_IO, ERL_ERROR);
+    return end - ofs;
+}
 
-    // No error = the size of the data read
+//
+// Read the whole image into the shadow copy
+//
+int flpdisk::loadShadow() {
+    if (this->rawRead(0, this->shadow, this->layout.szImage) != (int)this->layout.szImage) {
+        delete[] this->shadow;
+        this->shadow = NULL;
+        return this->setError("Unable to read the floppy image", strerror(errno), ERR_IO, ERL_ERROR);
+    }
+    if ((this->layout.options & LO_SUPERBLOCK) != 0) this->resets = ((superblock *)this->shadow)->resets;
+    return ERR_NONE;
+}
+
+//
+// Write a region of the image
+//
+int flpdisk::ioWrite(unsigned int ofs, const void * buffer, unsigned int szLen, const char * what) {
+
+    // Make sure floppy is ready    
+    if (!this->ready()) return ERR_NOTREADY;
+    if (this->stats != NULL) this->stats->bytesOut += szLen;
+
+    // Memory-mapped or positional write
+    if (this->map != NULL) {
+        memcpy(this->map + ofs, buffer, szLen);
+    } else if (this->rawWrite(ofs, buffer, szLen) != (int)szLen) {
+        return this->setError(what,strerror(errno), ERR_IO, ERL_ERROR);
+    } else if (this->shadow != NULL) {
+        memcpy(this->shadow + ofs, buffer, szLen);
+    }
+
+    // Make the change visible to the other end
+    int lRet = this->syncAt(SP_WRITE, ofs, szLen);
+    if (lRet < 0) return lRet;
+
+    // No error = the size of the data written
     return szLen;
 
 }
 
-
 //
-// Write the input buffer
+// Write a vector of buffers to a contiguous region of the image
 //
-int flpdisk::write_in(char * buffer, int szLen) {
+// Unlike ioWrite() this does not synchronize before writing. It is
+// up to the caller to place the ordering barrier.
+//
+int flpdisk::ioWritev(unsigned int ofs, const struct iovec * iov, int iovcnt, const char * what) {
+    int szLen = 0;
 
     // Make sure floppy is ready    
     if (!this->ready()) return ERR_NOTREADY;
+    for (int i=0; i<iovcnt; i++) szLen += iov[i].iov_len;
+    if (this->stats != NULL) this->stats->bytesOut += szLen;
+
+    // Memory-mapped I/O: Gather into the map
+    if (this->map != NULL) {
+        char * dst = this->map + ofs;
+        for (int i=0; i<iovcnt; i++) {
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+        return szLen;
+    }
 
-    // Prevent overflow
-    if (szLen > this->layout.szBufferIn)
-        szLen = this->layout.szBufferIn;
+    // Only the sectors that changed
+    if (this->shadow != NULL) return this->deltaWritev(ofs, iov, iovcnt, what);
+
+    // Positional vectored write
+    if (!this->useDirect) this->countCall(SC_PWRITEV);
+    if ((this->useDirect ? this->directWritev(ofs, iov, iovcnt) : pwritev(this->fd, iov, iovcnt, ofs)) != szLen)
+        return this->setError(what,strerror(errno), ERR_IO, ERL_ERROR);
+
+    // No error = the size of the data written
+    return szLen;
+
+}
+
+//
+// Locate the payload region of the input or output buffer
+//
+// Clamps the requested length to the buffer size and skips
+// the extended header if we are using the extended protocol.
+//
+int flpdisk::payloadRegion(bool input, unsigned int slot, unsigned int * ofs, int * szLen) {
+    unsigned int szBuffer = input ? this->layout.szBufferIn : this->layout.szBufferOut;
+    *ofs = this->ofsBuffer(input, slot);
 
     // If we are using extended version, skip extended header
-    int szOffset = this->layout.ofsBufferIn;
     if (this->useExtended) {
+        szBuffer -= SZ_EXTENDED_HEADER;
+        *ofs += SZ_EXTENDED_HEADER;
+    }
 
-        // Check for overflow if we shift the output
-        if (szLen + SZ_EXTENDED_HEADER > this->layout.szBufferIn)
-            szLen = this->layout.szBufferIn-SZ_EXTENDED_HEADER;
+    // Prevent overflow
+    if (*szLen < 0) *szLen = 0;
+    if (*szLen > (int)szBuffer) *szLen = szBuffer;
 
-        // Seek a bit further
-        szOffset += SZ_EXTENDED_HEADER;
-        
-    }
+    return ERR_NONE;
+}
+
+//
+// The payload of the inline frame fetched for the slot
+//
+// Clamps szLen to the frame. Returns NULL if the message in the slot
+// is not an inline frame that fetch_in already read.
+//
+const char * flpdisk::inlinePayload(unsigned int slot, int * szLen) {
+    if ((slot >= (unsigned int)MAX_SLOTS) || !this->inFrameValid[slot]) return NULL;
+    char * frame = this->inFrames + slot * SZ_SECTOR;
+    frame_lead * lead = (frame_lead *) frame;
+    unsigned int ofsPayload;
+
+    ofsPayload = this->ofsBuffer(true, slot) - this->ofsControl(true, slot) + (this->useExtended ? SZ_EXTENDED_HEADER : 0);
+    if (ofsPayload + lead->szInline > (unsigned int)SZ_SECTOR) return NULL;
+
+    if (*szLen < 0) *szLen = 0;
+    if (*szLen > (int)lead->szInline) *szLen = lead->szInline;
+    return frame + ofsPayload;
+}
 
-    // Seek to the input control byte
-    if (lseek(this->fd, szOffset, SEEK_SET) == -1)
-        return this->setError("Unable to write input buffer",strerror(errno), ERR_IO, ERL_ERROR);
+//
+// ==[ Direct views ]=================================================
+//
 
-    // Try to read input
-    this->sync();
-    if (write(this->fd, buffer, szLen) != szLen) 
-        return this->setError("Unable to write input buffer",strerror(errno), ERR_IO, ERL_ERROR);
+ctrlbyte * flpdisk::in_cb_view(unsigned int slot) {
+    if ((this->map == NULL) || (slot >= this->layout.numSlots)) return NULL;
+    return (ctrlbyte *)(this->map + this->ofsControl(true, slot));
+}
 
-    // No error = the size of the data read
-    return szLen;
+ctrlbyte * flpdisk::out_cb_view(unsigned int slot) {
+    if ((this->map == NULL) || (slot >= this->layout.numSlots)) return NULL;
+    return (ctrlbyte *)(this->map + this->ofsControl(false, slot));
+}
+
+extended_header * flpdisk::in_xhdr_view(unsigned int slot) {
+    if ((this->map == NULL) || !this->useExtended || (slot >= this->layout.numSlots)) return NULL;
+    return (extended_header *)(this->map + this->ofsBuffer(true, slot));
+}
 
+extended_header * flpdisk::out_xhdr_view(unsigned int slot) {
+    if ((this->map == NULL) || !this->useExtended || (slot >= this->layout.numSlots)) return NULL;
+    return (extended_header *)(this->map + this->ofsBuffer(false, slot));
+}
+
+char * flpdisk::in_buffer_view(unsigned int slot) {
+    if ((this->map == NULL) || (slot >= this->layout.numSlots)) return NULL;
+    return this->map + this->ofsBuffer(true, slot) + (this->useExtended ? SZ_EXTENDED_HEADER : 0);
+}
+
+char * flpdisk::out_buffer_view(unsigned int slot) {
+    if ((this->map == NULL) || (slot >= this->layout.numSlots)) return NULL;
+    return this->map + this->ofsBuffer(false, slot) + (this->useExtended ? SZ_EXTENDED_HEADER : 0);
 }
 
 //
-// Read the out buffer
+// Offset of the control byte of the given slot
+//
+unsigned int flpdisk::ofsControl(bool input, unsigned int slot) {
+    if (input) return this->layout.ofsControlIn + slot * this->layout.szStrideIn;
+    return this->layout.ofsControlOut + slot * this->layout.szStrideOut;
+}
+
+//
+// Offset of the buffer of the given slot
+//
+unsigned int flpdisk::ofsBuffer(bool input, unsigned int slot) {
+    if (input) return this->layout.ofsBufferIn + slot * this->layout.szStrideIn;
+    return this->layout.ofsBufferOut + slot * this->layout.szStrideOut;
+}
+
+//
+// Make sure the slot exists in the layout
+//
+int flpdisk::checkSlot(unsigned int slot) {
+    if (slot >= this->layout.numSlots)
+        return this->setError("Slot out of range", "Usage error", ERR_INVALID, ERL_ERROR);
+    return ERR_NONE;
+}
+
+//
+// ==[ Message commit/fetch ]=========================================
+//
+
+//
+// Commit an outgoing message
+//
+// Writes the extended header (if any) and the payload with a single
+// vectored write, places exactly one ordering barrier, and only then
+// publishes the control byte. The other end can therefore never see
+// the control byte before the data it guards.
+//
+// On memory-mapped images the buffer can be NULL if the payload was
+// already written in place (see out_buffer_view).
+//
+// On aligned layouts a message that fits in the first sector of the
+// slot goes out as an inline frame. With O_DIRECTIO it is published
+// with one sector write, since the media never shows half a sector.
+//
+// @return  The number of payload bytes written or an error code
+//
+int flpdisk::commit_out(const char * buffer, int szLen, ctrlbyte * cb, extended_header * hdr, unsigned int slot) {
+    struct iovec iov;
+
+    // A NULL buffer means the payload was already written in place
+    if (buffer == NULL) {
+        if (this->map == NULL)
+            return this->setError("Payload in place requires a memory-mapped image", "Usage error", ERR_INVALID, ERL_ERROR);
+        return this->commitOut(NULL, 0, szLen, cb, hdr, slot);
+    }
+
+    iov.iov_base = (void *) buffer;
+    iov.iov_len = (szLen < 0) ? 0 : szLen;
+    return this->commitOut(&iov, 1, szLen, cb, hdr, slot);
+}
+
+//
+// Commit an outgoing message gathered from several buffers
+//
+// Same as commit_out, with the payload being the concatenation of up
+// to MAX_IOV buffers.
+//
+int flpdisk::commit_outv(const struct iovec * iov, int iovcnt, ctrlbyte * cb, extended_header * hdr, unsigned int slot) {
+    int szLen = 0;
+    if ((iovcnt < 0) || (iovcnt > MAX_IOV))
+        return this->setError("Too many pieces in the message", "Usage error", ERR_INVALID, ERL_ERROR);
+    for (int i=0; i<iovcnt; i++) szLen += iov[i].iov_len;
+    return this->commitOut(iov, iovcnt, szLen, cb, hdr, slot);
+}
+
+//
+// Common part of commit_out and commit_outv
+//
+// Times the commit when stats are enabled.
+//
+int flpdisk::commitOut(const struct iovec * iov, int iovcnt, int szLen, ctrlbyte * cb, extended_header * hdr, unsigned int slot) {
+    if (this->stats == NULL) return this->writeMessage(iov, iovcnt, szLen, cb, hdr, slot);
+
+    unsigned long long tStart = monotonic_time();
+    int lRet = this->writeMessage(iov, iovcnt, szLen, cb, hdr, slot);
+    this->stats->commitTime.add(monotonic_time() - tStart);
+    if (lRet >= 0) this->stats->messagesOut[cb->sID]++;
+    return lRet;
+}
+
 //
-int flpdisk::write_out(char * buffer, int szLen) {
+// Write a message: payload, header and control byte
+//
+int flpdisk::writeMessage(const struct iovec * iov, int iovcnt, int szLen, ctrlbyte * cb, extended_header * hdr, unsigned int slot) {
+    struct iovec vec[MAX_IOV + 2];
+    frame_lead lead;
+    int veccnt = 0, lRet;
+    unsigned int szOffset, ofsEnd;
 
     // Make sure floppy is ready    
     if (!this->ready()) return ERR_NOTREADY;
+    if ((lRet = this->checkSlot(slot)) < 0) return lRet;
 
-    // Prevent overflow
-    if (szLen > this->layout.szBufferOut)
-        szLen = this->layout.szBufferOut;
+    // Clamp the payload to the buffer
+    this->payloadRegion(false, slot, &szOffset, &szLen);
+    ofsEnd = szOffset + szLen;
 
-    // If we are using extended version, skip extended header
-    int szOffset = this->layout.ofsBufferOut;
+    // The extended header sits right in front of the payload
     if (this->useExtended) {
+        if (hdr == NULL) return this->setError("Extended protocol requires a header to commit", "Usage error", ERR_INVALID, ERL_ERROR);
+        vec[veccnt].iov_base = hdr->value;
+        vec[veccnt].iov_len = SZ_EXTENDED_HEADER;
+        veccnt++;
+        szOffset -= SZ_EXTENDED_HEADER;
+    }
+    veccnt += clipIov(iov, iovcnt, szLen, vec + veccnt);
+
+    // On aligned layouts the lead goes in front, telling the reader
+    // if the message is an inline frame
+    unsigned int ofsCB = this->ofsControl(false, slot);
+    if ((this->layout.options & LO_ALIGNED) != 0) {
+        bool bInline = this->useInline && (iov != NULL) && (szOffset + szLen + (this->useExtended ? SZ_EXTENDED_HEADER : 0) <= ofsCB + SZ_SECTOR);
+        memset(lead.value, 0, sizeof(lead));
+        lead.cb = cb->value;
+        if (bInline) {
+            lead.fflags = FF_INLINE;
+            lead.szInline = szLen;
+        }
+        memmove(vec + 1, vec, veccnt * sizeof(struct iovec));
+        vec[0].iov_base = lead.value;
+        vec[0].iov_len = szOffset - ofsCB;
+        veccnt++;
+
+        // Everything in one sector that cannot be seen half written: Single write
+        if (bInline && this->useDirect) {
+            lRet = this->ioWritev(ofsCB, vec, veccnt, "Unable to write output buffer");
+            if (lRet < 0) return lRet;
+            lRet = this->syncAt(SP_WRITE, ofsCB, lRet);
+            if (lRet < 0) return lRet;
+            this->traceEvent(TE_PUBLISH, cb->sID, slot, szLen);
+            return szLen;
+        }
 
-        // Check for overflow if we shift the output
-        if (szLen + SZ_EXTENDED_HEADER > this->layout.szBufferOut)
-            szLen = this->layout.szBufferOut-SZ_EXTENDED_HEADER;
+        // Otherwise the control byte still comes last
+        vec[0].iov_base = lead.value + 1;
+        vec[0].iov_len--;
+        szOffset = ofsCB + 1;
+    }
 
-        // Seek a bit further
-        szOffset += SZ_EXTENDED_HEADER;
-        
+    // Payload + header
+    if (veccnt > 0) {
+        lRet = this->ioWritev(szOffset, vec, veccnt, "Unable to write output buffer");
+        if (lRet < 0) return lRet;
     }
+    this->traceEvent(TE_PAYLOAD, cb->sID, slot, szLen);
 
-    // Seek to the input control byte
-    if (lseek(this->fd, szOffset, SEEK_SET) == -1)
-        return this->setError("Unable to write output buffer",strerror(errno), ERR_IO, ERL_ERROR);
+    // The one ordering barrier, also over a payload written in place
+    lRet = this->syncAt(SP_COMMIT, szOffset, ofsEnd - szOffset);
+    if (lRet < 0) return lRet;
 
-    // Try to read input
-    this->sync();
-    if (write(this->fd, buffer, szLen) != szLen) 
-        return this->setError("Unable to write output buffer",strerror(errno), ERR_IO, ERL_ERROR);
+    // Publish the control byte
+    lRet = this->ioWrite(ofsCB, &cb->value, 1, "Unable to write output control byte");
+    if (lRet < 0) return lRet;
+    this->traceEvent(TE_PUBLISH, cb->sID, slot, szLen);
 
-    // No error = the size of the data read
+    // Return the payload size
     return szLen;
 
 }
 
+//
+// Fetch the state of an incoming message
+//
+// Reads the input control byte and, on the extended protocol, the
+// extended header. When the two are close to each other on the image
+// they are fetched with a single read.
+//
+// On aligned layouts the whole first sector of the slot is read, and
+// an inline frame is then served from it by read_in and read_inv.
+//
+int flpdisk::fetch_in(ctrlbyte * cb, extended_header * hdr, unsigned int slot) {
+    int lRet = this->fetchIn(cb, hdr, slot);
+    if ((lRet == ERR_NONE) && cb->bDataPresent)
+        this->traceEvent(TE_FETCH, cb->sID, slot, (this->useExtended && (hdr != NULL)) ? (int)hdr->szLength : -1);
+    return lRet;
+}
+
+//
+// Read control byte and header (see fetch_in)
+//
+int flpdisk::fetchIn(ctrlbyte * cb, extended_header * hdr, unsigned int slot) {
+    unsigned int ofsCB = this->ofsControl(true, slot);
+    unsigned int ofsHDR = this->ofsBuffer(true, slot);
+    int lRet;
+
+    // Control byte, lead, header and the start of the payload
+    if (((this->layout.options & LO_ALIGNED) != 0) && (this->map == NULL)) {
+        if ((lRet = this->checkSlot(slot)) < 0) return lRet;
+        char * frame = this->inFrames + slot * SZ_SECTOR;
+        frame_lead * lead = (frame_lead *) frame;
+        this->inFrameValid[slot] = false;
+        lRet = this->ioRead(ofsCB, frame, SZ_SECTOR, SP_READ_CONTROL, "Unable to read input control byte");
+        if (lRet < 0) return lRet;
+        cb->value = lead->cb;
+        if (this->useExtended && (hdr != NULL)) memcpy(hdr->value, frame + (ofsHDR - ofsCB), SZ_EXTENDED_HEADER);
+        if (cb->bDataPresent && (lead->fflags & FF_INLINE)) this->inFrameValid[slot] = true;
+        return ERR_NONE;
+    }
+
+    // Without the extended protocol there is only the control byte
+    if (!this->useExtended || (hdr == NULL))
+        return this->get_in_cb(cb, slot);
+    if ((lRet = this->checkSlot(slot)) < 0) return lRet;
+
+    // Control byte followed closely by the header: Single read
+    if ((ofsHDR > ofsCB) && (ofsHDR + SZ_EXTENDED_HEADER - ofsCB <= SZ_FETCH_SPAN)) {
+        unsigned char buf[SZ_FETCH_SPAN];
+        unsigned int szSpan = ofsHDR + SZ_EXTENDED_HEADER - ofsCB;
+        lRet = this->ioRead(ofsCB, buf, szSpan, SP_READ_CONTROL, "Unable to read input control byte");
+        if (lRet < 0) return lRet;
+        cb->value = buf[0];
+        memcpy(hdr->value, buf + (ofsHDR - ofsCB), SZ_EXTENDED_HEADER);
+        return ERR_NONE;
+    }
+
+    // Otherwise read them separately
+    lRet = this->get_in_cb(cb, slot);
+    if (lRet < 0) return lRet;
+    return this->get_in_xhdr(hdr, slot);
+
+}
+
+//
+// ==[ I/O Functions ]================================================
+//
+
+//
+// Read the INPUT Extended header
+// 
+int flpdisk::get_in_xhdr(extended_header * hdr, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+
+    // If we are not using extended protocol raise error
+    if (!this->useExtended) return this->setError("You asked for XHDR operations, but you are not using extended protocol", "Usage error", ERR_INVALID, ERL_ERROR);
+
+    int lRet = this->ioRead(this->ofsBuffer(true, slot), hdr->value, SZ_EXTENDED_HEADER, SP_READ_DATA, "Unable to read input extended header");
+    return (lRet < 0) ? lRet : ERR_NONE;
+}
+
+//
+// Read the OUTPUT Extended header
+// 
+int flpdisk::get_out_xhdr(extended_header * hdr, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+
+    // If we are not using extended protocol raise error
+    if (!this->useExtended) return this->setError("You asked for XHDR operations, but you are not using extended protocol", "Usage error", ERR_INVALID, ERL_ERROR);
+
+    int lRet = this->ioRead(this->ofsBuffer(false, slot), hdr->value, SZ_EXTENDED_HEADER, SP_READ_DATA, "Unable to read output extended header");
+    return (lRet < 0) ? lRet : ERR_NONE;
+}
+
+//
+// Write the INPUT Extended header
+// 
+int flpdisk::set_in_xhdr(extended_header * hdr, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+
+    // If we are not using extended protocol raise error
+    if (!this->useExtended) return this->setError("You asked for XHDR operations, but you are not using extended protocol", "Usage error", ERR_INVALID, ERL_ERROR);
+
+    int lRet = this->ioWrite(this->ofsBuffer(true, slot), hdr->value, SZ_EXTENDED_HEADER, "Unable to write input extended header");
+    return (lRet < 0) ? lRet : ERR_NONE;
+}
+
+//
+// Write the OUTPUT Extended header
+// 
+int flpdisk::set_out_xhdr(extended_header * hdr, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+
+    // If we are not using extended protocol raise error
+    if (!this->useExtended) return this->setError("You asked for XHDR operations, but you are not using extended protocol", "Usage error", ERR_INVALID, ERL_ERROR);
+
+    int lRet = this->ioWrite(this->ofsBuffer(false, slot), hdr->value, SZ_EXTENDED_HEADER, "Unable to write output extended header");
+    return (lRet < 0) ? lRet : ERR_NONE;
+}
+
+//
+// Read the INPUT Control byte
+// 
+int flpdisk::get_in_cb(ctrlbyte * cb, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+    int lRet = this->ioRead(this->ofsControl(true, slot), &cb->value, 1, SP_READ_CONTROL, "Unable to read input control byte");
+    return (lRet < 0) ? lRet : ERR_NONE;
+}
+
+//
+// Read the OUTPUT Control byte
+// 
+int flpdisk::get_out_cb(ctrlbyte * cb, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+    int lRet = this->ioRead(this->ofsControl(false, slot), &cb->value, 1, SP_READ_CONTROL, "Unable to read output control byte");
+    return (lRet < 0) ? lRet : ERR_NONE;
+}
+
+//
+// Write the INPUT Control byte
+// 
+int flpdisk::set_in_cb(ctrlbyte * cb, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+    this->inFrameValid[slot] = false;
+    int lRet = this->ioWrite(this->ofsControl(true, slot), &cb->value, 1, "Unable to write input control byte");
+    return (lRet < 0) ? lRet : ERR_NONE;
+}
+
+//
+// Write the OUTPUT Control byte
+// 
+int flpdisk::set_out_cb(ctrlbyte * cb, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+    int lRet = this->ioWrite(this->ofsControl(false, slot), &cb->value, 1, "Unable to write output control byte");
+    return (lRet < 0) ? lRet : ERR_NONE;
+}
+
+//
+// Read the input buffer
+//
+int flpdisk::read_in(char * buffer, int szLen, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+    const char * frame = this->inlinePayload(slot, &szLen);
+    if (frame != NULL) {
+        memcpy(buffer, frame, szLen);
+        return szLen;
+    }
+    unsigned int szOffset;
+    this->payloadRegion(true, slot, &szOffset, &szLen);
+    return this->ioRead(szOffset, buffer, szLen, SP_READ_DATA, "Unable to read input buffer");
+}
+
+//
+// Read the out buffer
+//
+int flpdisk::read_out(char * buffer, int szLen, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+    unsigned int szOffset;
+    this->payloadRegion(false, slot, &szOffset, &szLen);
+    return this->ioRead(szOffset, buffer, szLen, SP_READ_DATA, "Unable to read output buffer");
+}
+
+//
+// Write the input buffer
+//
+int flpdisk::write_in(char * buffer, int szLen, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+    unsigned int szOffset;
+    this->payloadRegion(true, slot, &szOffset, &szLen);
+    return this->ioWrite(szOffset, buffer, szLen, "Unable to write input buffer");
+}
+
+//
+// Write the out buffer
+//
+int flpdisk::write_out(char * buffer, int szLen, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+    unsigned int szOffset;
+    this->payloadRegion(false, slot, &szOffset, &szLen);
+    return this->ioWrite(szOffset, buffer, szLen, "Unable to write output buffer");
+}
+
+//
+// Read the in buffer into several buffers
+//
+// Reads up to szLen bytes, filling the buffers in order.
+//
+int flpdisk::read_inv(const struct iovec * iov, int iovcnt, int szLen, unsigned int slot) {
+    struct iovec vec[MAX_IOV];
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+    if ((iovcnt < 0) || (iovcnt > MAX_IOV))
+        return this->setError("Too many pieces in the message", "Usage error", ERR_INVALID, ERL_ERROR);
+    const char * frame = this->inlinePayload(slot, &szLen);
+    if (frame != NULL) {
+        iovcnt = clipIov(iov, iovcnt, szLen, vec);
+        for (int i=0; i<iovcnt; i++) {
+            memcpy(vec[i].iov_base, frame, vec[i].iov_len);
+            frame += vec[i].iov_len;
+        }
+        return szLen;
+    }
+    unsigned int szOffset;
+    this->payloadRegion(true, slot, &szOffset, &szLen);
+    iovcnt = clipIov(iov, iovcnt, szLen, vec);
+    return this->ioReadv(szOffset, vec, iovcnt, SP_READ_DATA, "Unable to read input buffer");
+}
+
+//
+// Point at the in buffer instead of reading it
+//
+// Only possible on memory-mapped images. Applies the read sync policy
+// to the viewed range like read_in does.
+//
+// @return  The number of bytes in the view or an error code
+//
+int flpdisk::peek_in(const char ** view, int szLen, unsigned int slot) {
+    if (this->checkSlot(slot) < 0) return ERR_INVALID;
+    if (this->map == NULL) return this->setError("Views require a memory-mapped image", "Usage error", ERR_INVALID, ERL_ERROR);
+    unsigned int szOffset;
+    int lRet;
+    this->payloadRegion(true, slot, &szOffset, &szLen);
+    lRet = this->syncAt(SP_READ_DATA, szOffset, szLen);
+    if (lRet < 0) return lRet;
+    *view = this->map + szOffset;
+    return szLen;
+}
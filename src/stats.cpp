@@ -0,0 +1,198 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   stats.cpp
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Instrumentation counters and histograms
+//
+
+#include <time.h>
+#include <sstream>
+
+#include "../includes/stats.h"
+
+using namespace std;
+using namespace fpio;
+
+static const char * SYSCALL_NAMES[NUM_SYSCALLS] = {
+    "pread", "pwrite", "preadv", "pwritev", "fsync", "fdatasync", "msync", "ioctl"
+};
+
+// ===================================================================
+// stat_counter
+// ===================================================================
+
+void stat_counter::operator++(int) {
+    this->value.fetch_add(1, memory_order_relaxed);
+}
+
+void stat_counter::operator+=(unsigned long long n) {
+    this->value.fetch_add(n, memory_order_relaxed);
+}
+
+//
+// Keep the largest value seen
+//
+void stat_counter::raise(unsigned long long n) {
+    unsigned long long cur = this->value.load(memory_order_relaxed);
+    while ((n > cur) && !this->value.compare_exchange_weak(cur, n, memory_order_relaxed)) { }
+}
+
+void stat_counter::reset() {
+    this->value.store(0, memory_order_relaxed);
+}
+
+stat_counter::operator unsigned long long() const {
+    return this->value.load(memory_order_relaxed);
+}
+
+// ===================================================================
+// histogram
+// ===================================================================
+
+void histogram::add(unsigned long long value) {
+    int b = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+    if (b >= NUM_HIST_BUCKETS) b = NUM_HIST_BUCKETS - 1;
+    this->buckets[b]++;
+    this->count++;
+    this->sum += value;
+    this->max.raise(value);
+}
+
+void histogram::clear() {
+    this->count.reset();
+    this->sum.reset();
+    this->max.reset();
+    for (int b=0; b<NUM_HIST_BUCKETS; b++) this->buckets[b].reset();
+}
+
+//
+// Upper bound of the bucket holding the given fraction of the values
+//
+unsigned long long histogram::percentile(double p) const {
+    unsigned long long n = 0, target = (unsigned long long)(p * this->count);
+    if (this->count == 0) return 0;
+    for (int b=0; b<NUM_HIST_BUCKETS; b++) {
+        n += this->buckets[b];
+        if (n > target) {
+            unsigned long long bound = (b == 0) ? 0 : (1ULL << b) - 1;
+            return (bound < this->max) ? bound : this->max;
+        }
+    }
+    return this->max;
+}
+
+//
+// Text lines for a histogram, skipping empty buckets
+//
+static void histogramText(ostringstream & os, const char * name, const histogram & h) {
+    os << name << ": count=" << h.count << " avg=" << (h.count ? h.sum / h.count : 0)
+       << " p50<=" << h.percentile(0.5) << " p99<=" << h.percentile(0.99) << " max=" << h.max << "\n";
+    for (int b=0; b<NUM_HIST_BUCKETS; b++) {
+        if (h.buckets[b] == 0) continue;
+        if (b == 0) os << "  [0]        ";
+        else os << "  [" << (1ULL << (b - 1)) << ", " << (1ULL << b) << ")  ";
+        os << h.buckets[b] << "\n";
+    }
+}
+
+static void histogramJSON(ostringstream & os, const histogram & h) {
+    os << "{ \"count\": " << h.count << ", \"sum\": " << h.sum << ", \"max\": " << h.max << ", \"buckets\": [";
+    for (int b=0; b<NUM_HIST_BUCKETS; b++) os << (b ? ", " : "") << h.buckets[b];
+    os << "] }";
+}
+
+// ===================================================================
+// io_stats
+// ===================================================================
+
+void io_stats::clear() {
+    for (int i=0; i<NUM_SYSCALLS; i++) this->syscalls[i].reset();
+    this->syncs.reset();
+    this->bytesIn.reset();
+    this->bytesOut.reset();
+    this->bytesFlushed.reset();
+    for (int i=0; i<NUM_STAT_STREAMS; i++) {
+        this->messagesIn[i].reset();
+        this->messagesOut[i].reset();
+    }
+    this->polls.reset();
+    this->timeouts.reset();
+    this->waitTime.clear();
+    this->commitTime.clear();
+}
+
+//
+// Human readable dump
+//
+string io_stats::text() const {
+    ostringstream os;
+
+    os << "syscalls:";
+    for (int i=0; i<NUM_SYSCALLS; i++) os << " " << SYSCALL_NAMES[i] << "=" << this->syscalls[i];
+    os << "\nsyncs: " << this->syncs << "\n";
+    os << "bytes: in=" << this->bytesIn << " out=" << this->bytesOut << " flushed=" << this->bytesFlushed << "\n";
+    os << "messages in:";
+    for (int i=0; i<NUM_STAT_STREAMS; i++) os << " " << i << "=" << this->messagesIn[i];
+    os << "\nmessages out:";
+    for (int i=0; i<NUM_STAT_STREAMS; i++) os << " " << i << "=" << this->messagesOut[i];
+    os << "\npolls: " << this->polls << " timeouts: " << this->timeouts << "\n";
+    histogramText(os, "wait time (us)", this->waitTime);
+    histogramText(os, "commit time (us)", this->commitTime);
+
+    return os.str();
+}
+
+//
+// Machine readable dump
+//
+// Histogram bucket N counts the values in [2^(N-1), 2^N), bucket 0
+// the zeroes.
+//
+string io_stats::json() const {
+    ostringstream os;
+
+    os << "{ \"syscalls\": { ";
+    for (int i=0; i<NUM_SYSCALLS; i++) os << (i ? ", " : "") << "\"" << SYSCALL_NAMES[i] << "\": " << this->syscalls[i];
+    os << " }, \"syncs\": " << this->syncs;
+    os << ", \"bytes_in\": " << this->bytesIn << ", \"bytes_out\": " << this->bytesOut << ", \"bytes_flushed\": " << this->bytesFlushed;
+    os << ", \"messages_in\": [";
+    for (int i=0; i<NUM_STAT_STREAMS; i++) os << (i ? ", " : "") << this->messagesIn[i];
+    os << "], \"messages_out\": [";
+    for (int i=0; i<NUM_STAT_STREAMS; i++) os << (i ? ", " : "") << this->messagesOut[i];
+    os << "], \"polls\": " << this->polls << ", \"timeouts\": " << this->timeouts;
+    os << ", \"wait_us\": ";
+    histogramJSON(os, this->waitTime);
+    os << ", \"commit_us\": ";
+    histogramJSON(os, this->commitTime);
+    os << " }";
+
+    return os.str();
+}
+
+// ===================================================================
+// Clock
+// ===================================================================
+
+unsigned long long fpio::monotonic_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
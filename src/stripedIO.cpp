@@ -0,0 +1,422 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis 
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   stripedIO.cpp
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// One logical channel striped over several floppyIO images
+//
+
+#include <string.h>
+#include <sys/uio.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "../includes/stripedIO.h"
+
+using namespace std;
+using namespace fpio;
+
+//
+// A chunk of a striped transfer
+//
+struct stripe_chunk {
+    stripe_header   hdr;
+    char *          data;
+    int             size;
+};
+
+static void freeChunk(stripe_chunk * c) {
+    if (c->data != NULL) delete[] c->data;
+    delete c;
+}
+
+//
+// A bounded queue of chunks between the stream and a stripe thread
+//
+// Closing it makes push() fail, and pop() return NULL once the
+// queued chunks are gone.
+//
+// Chunks are given back with recycle() once their data was used,
+// and take() hands them out again, so a transfer only allocates the
+// few chunks a stripe has in flight.
+//
+class chunk_queue {
+public:
+
+    chunk_queue() {
+        this->closed = false;
+    }
+
+    ~chunk_queue() {
+        for (size_t i=0; i<this->chunks.size(); i++) freeChunk(this->chunks[i]);
+        for (size_t i=0; i<this->spares.size(); i++) freeChunk(this->spares[i]);
+    }
+
+    stripe_chunk * take(int szChunk) {
+        {
+            lock_guard<mutex> guard(this->lock);
+            if (!this->spares.empty()) {
+                stripe_chunk * c = this->spares.back();
+                this->spares.pop_back();
+                return c;
+            }
+        }
+        stripe_chunk * c = new stripe_chunk;
+        c->data = new char[szChunk];
+        return c;
+    }
+
+    void recycle(stripe_chunk * c) {
+        if (c->data == NULL) {
+            freeChunk(c);
+            return;
+        }
+        lock_guard<mutex> guard(this->lock);
+        this->spares.push_back(c);
+    }
+
+    bool push(stripe_chunk * c) {
+        unique_lock<mutex> guard(this->lock);
+        this->changed.wait(guard, [this] { return this->closed || (this->chunks.size() < (size_t)STRIPE_QUEUE_DEPTH); });
+        if (this->closed) return false;
+        this->chunks.push_back(c);
+        this->changed.notify_all();
+        return true;
+    }
+
+    stripe_chunk * pop() {
+        unique_lock<mutex> guard(this->lock);
+        this->changed.wait(guard, [this] { return this->closed || !this->chunks.empty(); });
+        if (this->chunks.empty()) return NULL;
+        stripe_chunk * c = this->chunks.front();
+        this->chunks.pop_front();
+        this->changed.notify_all();
+        return c;
+    }
+
+    void close() {
+        lock_guard<mutex> guard(this->lock);
+        this->closed = true;
+        this->changed.notify_all();
+    }
+
+private:
+
+    mutex                   lock;
+    condition_variable      changed;
+    deque<stripe_chunk *>   chunks;
+    vector<stripe_chunk *>  spares;         // Chunks of the stripe's size to fill again
+    bool                    closed;
+
+};
+
+//
+// Send the chunks of one stripe (runs in its own thread)
+//
+// After an error the rest of the chunks are dropped, and the queue
+// is closed so that the stream stops feeding it. An aborted stripe
+// is reported to the other end.
+//
+static void sendStripe(floppyIO * io, chunk_queue * queue, unsigned short id, int * result) {
+    stripe_chunk * c;
+    while ((c = queue->pop()) != NULL) {
+        if (*result >= 0) {
+            struct iovec iov[2];
+            iov[0].iov_base = &c->hdr;
+            iov[0].iov_len = sizeof(stripe_header);
+            iov[1].iov_base = c->data;
+            iov[1].iov_len = c->size;
+            int lRet = io->send(iov, (c->size > 0) ? 2 : 1, id);
+            if (lRet < 0) {
+                *result = lRet;
+                queue->close();
+
+                // The other end waits on this stripe for a chunk that
+                // will never come: tell it
+                if (lRet == ERR_ABORTED) {
+                    io->clear();
+                    io->sendAbort(id);
+                }
+            }
+        }
+        queue->recycle(c);
+    }
+}
+
+//
+// Receive the chunks of one stripe (runs in its own thread)
+//
+// Stops after the end marker of the stripe, on an error, or when
+// the queue is closed.
+//
+static void receiveStripe(floppyIO * io, chunk_queue * queue, int szChunk, unsigned short id, int * result) {
+    for (;;) {
+        stripe_chunk * c = queue->take(szChunk);
+
+        struct iovec iov[2];
+        iov[0].iov_base = &c->hdr;
+        iov[0].iov_len = sizeof(stripe_header);
+        iov[1].iov_base = c->data;
+        iov[1].iov_len = szChunk;
+        int lRet = io->receive(iov, 2, id);
+        if (lRet < (int)sizeof(stripe_header)) {
+            freeChunk(c);
+            *result = (lRet < 0) ? lRet : ERR_INPUT;
+            break;
+        }
+        c->size = lRet - sizeof(stripe_header);
+
+        bool bLast = ((c->hdr.flags & SF_END) != 0);
+        if (!queue->push(c)) {
+            freeChunk(c);
+            break;
+        }
+        if (bLast) break;
+    }
+    queue->close();
+}
+
+//
+// Constructor
+//
+stripedIO::stripedIO(const vector<string> & files, int flags, int syncPolicy) {
+    this->open(files, flags, NULL, syncPolicy);
+}
+
+//
+// Constructor with explicit disk layout
+//
+stripedIO::stripedIO(const vector<string> & files, int flags, const disk_layout & layout, int syncPolicy) {
+    this->open(files, flags, &layout, syncPolicy);
+}
+
+//
+// Open the images
+//
+// The stripes report their errors to us: exceptions thrown in the
+// I/O threads would have nobody to catch them.
+//
+void stripedIO::open(const vector<string> & files, int flags, const disk_layout * layout, int syncPolicy) {
+    this->clear();
+    this->useExceptions = ((flags & O_EXCEPTIONS) != 0);
+
+    if ((files.size() < 1) || (files.size() > (size_t)MAX_STRIPES)) {
+        this->setError("Invalid number of images", "Usage error", ERR_INVALID, ERL_ERROR);
+        return;
+    }
+
+    flags = (flags | O_EXTENDED | O_SYNCHRONIZED) & ~O_EXCEPTIONS;
+    for (size_t i=0; i<files.size(); i++) {
+        floppyIO * io;
+        if (layout != NULL) io = new floppyIO(files[i].c_str(), flags, *layout, syncPolicy);
+        else io = new floppyIO(files[i].c_str(), flags, syncPolicy);
+        this->stripes.push_back(io);
+        if (!io->ready()) {
+            this->setError("Unable to open " + files[i], io->errorStr, io->errorCode, ERL_ERROR);
+            return;
+        }
+    }
+}
+
+//
+// Destructor
+//
+stripedIO::~stripedIO() {
+    for (size_t i=0; i<this->stripes.size(); i++) delete this->stripes[i];
+}
+
+//
+// Ready if every image is
+//
+bool stripedIO::ready() {
+    if (!errorbase::ready()) return false;
+    for (size_t i=0; i<this->stripes.size(); i++) {
+        if (!this->stripes[i]->ready()) return false;
+    }
+    return !this->stripes.empty();
+}
+
+//
+// The number of images
+//
+int stripedIO::numStripes() {
+    return this->stripes.size();
+}
+
+//
+// One of the images, or NULL
+//
+floppyIO * stripedIO::stripe(int index) {
+    if ((index < 0) || (index >= (int)this->stripes.size())) return NULL;
+    return this->stripes[index];
+}
+
+//
+// The data that fits in one chunk of a stripe
+//
+int stripedIO::chunkSize(int index, bool input) {
+    floppyIO * io = this->stripes[index];
+    int szBuffer = input ? io->layout.szBufferIn : io->layout.szBufferOut;
+    return szBuffer - SZ_EXTENDED_HEADER - sizeof(stripe_header);
+}
+
+// 
+// Striped Sending Data
+//
+// The stream is read in chunks of one buffer, and chunk N is sent
+// on stripe N % numStripes by the thread of that stripe. A few
+// chunks per stripe are read ahead, so all the images are busy.
+//
+// @return  The bytes sent, or an error code
+//
+int stripedIO::send(istream * stream, unsigned short id) {
+    if (!this->ready()) return ERR_NOTREADY;
+    int numStripes = this->stripes.size();
+    vector<chunk_queue> queues(numStripes);
+    vector<int> results(numStripes, ERR_NONE);
+    vector<thread> workers;
+    for (int i=0; i<numStripes; i++)
+        workers.push_back(thread(sendStripe, this->stripes[i], &queues[i], id, &results[i]));
+
+    // Cut the stream in chunks
+    unsigned int seq = 0;
+    int sentLength = 0;
+    bool bFailed = false, bInputError = false;
+    for (;;) {
+        int k = seq % numStripes;
+        int szChunk = this->chunkSize(k, false);
+        stripe_chunk * c = queues[k].take(szChunk);
+        stream->read(c->data, szChunk);
+        c->size = stream->gcount();
+        if (stream->fail() && !stream->eof()) {
+            freeChunk(c);
+            bFailed = bInputError = true;
+            break;
+        }
+        if (c->size == 0) {
+            freeChunk(c);
+            break;
+        }
+
+        c->hdr.seq = seq;
+        c->hdr.flags = 0;
+        if (!queues[k].push(c)) {
+            freeChunk(c);
+            bFailed = true;
+            break;
+        }
+        sentLength += c->size;
+        seq++;
+        if (stream->eof()) break;
+    }
+
+    // End every stripe, telling the other end if we gave up
+    for (int i=0; i<numStripes; i++, seq++) {
+        int k = seq % numStripes;
+        stripe_chunk * c = new stripe_chunk;
+        c->data = NULL;
+        c->size = 0;
+        c->hdr.seq = seq;
+        c->hdr.flags = SF_END | (bFailed ? SF_ABORT : 0);
+        if (!queues[k].push(c)) freeChunk(c);
+        queues[k].close();
+    }
+    for (int i=0; i<numStripes; i++) workers[i].join();
+
+    // Report the first failure
+    for (int i=0; i<numStripes; i++) {
+        if (results[i] < 0)
+            return this->setError("Unable to send on stripe " + to_string(i), this->stripes[i]->errorStr, results[i], ERL_ERROR);
+    }
+    if (bInputError)
+        return this->setError("Unable to open input stream!", ERR_INPUT, ERL_ERROR);
+    return sentLength;
+}
+
+// 
+// Striped Receiving Data
+//
+// Every stripe is received by its own thread, and the chunks are
+// written to the stream in sequence order.
+//
+// @return  The bytes received, or an error code
+//
+int stripedIO::receive(ostream * stream, unsigned short id) {
+    if (!this->ready()) return ERR_NOTREADY;
+    int numStripes = this->stripes.size();
+    vector<chunk_queue> queues(numStripes);
+    vector<int> results(numStripes, ERR_NONE);
+    vector<thread> workers;
+    for (int i=0; i<numStripes; i++)
+        workers.push_back(thread(receiveStripe, this->stripes[i], &queues[i], this->chunkSize(i, true), id, &results[i]));
+
+    // Put the chunks back in order
+    unsigned int seq = 0;
+    int receivedLength = 0, lRet = ERR_NONE;
+    for (;;) {
+        int k = seq % numStripes;
+        stripe_chunk * c = queues[k].pop();
+        if (c == NULL) {
+            lRet = this->setError("Unable to receive on stripe " + to_string(k), this->stripes[k]->errorStr,
+                (results[k] < 0) ? results[k] : ERR_INPUT, ERL_ERROR);
+            break;
+        }
+        if (c->hdr.seq != seq) {
+            freeChunk(c);
+            lRet = this->setError("Stripes out of order", "Both ends must list the images in the same order", ERR_INPUT, ERL_ERROR);
+            break;
+        }
+        if ((c->hdr.flags & SF_ABORT) != 0) {
+            freeChunk(c);
+            lRet = this->setError("Transfer aborted", ERR_ABORTED, ERL_ERROR);
+            break;
+        }
+        if ((c->hdr.flags & SF_END) != 0) {
+            freeChunk(c);
+            break;
+        }
+
+        stream->write(c->data, c->size);
+        receivedLength += c->size;
+        queues[k].recycle(c);
+        seq++;
+    }
+    stream->flush();
+
+    // The threads stop at their end markers. If we stopped early,
+    // get them out of their waits.
+    if (lRet < 0) {
+        for (int i=0; i<numStripes; i++) {
+            queues[i].close();
+            this->stripes[i]->abort(id);
+        }
+    }
+    for (int i=0; i<numStripes; i++) workers[i].join();
+    if (lRet < 0) {
+        for (int i=0; i<numStripes; i++) this->stripes[i]->abort(id, false);
+        stream->setstate(ostream::badbit);
+        return lRet;
+    }
+
+    stream->setstate(ostream::eofbit);
+    return receivedLength;
+}
@@ -0,0 +1,132 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   trace.cpp
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Message lifecycle tracing
+//
+
+#include <unistd.h>
+#include <sstream>
+
+#include "../includes/trace.h"
+#include "../includes/stats.h"
+
+using namespace std;
+using namespace fpio;
+
+static const char * TRACE_NAMES[NUM_TRACE_TYPES] = {
+    "send", "receive", "wait in", "wait out", "reserve",
+    "payload written", "control published", "ack observed", "fetched", "consumed"
+};
+
+// ===================================================================
+// trace_ring
+// ===================================================================
+
+trace_ring::trace_ring(unsigned int capacity) {
+    if (capacity < 1) capacity = 1;
+    this->capacity = capacity;
+    this->ring = new trace_event[capacity];
+    for (unsigned int i=0; i<capacity; i++) this->ring[i].seq.store(0, memory_order_relaxed);
+    this->head.store(0, memory_order_relaxed);
+}
+
+trace_ring::~trace_ring() {
+    delete[] this->ring;
+}
+
+//
+// Append an event
+//
+// Safe to call from any thread. A writer that is overtaken by a whole
+// lap of the ring loses its event, which is fine for a trace.
+//
+void trace_ring::event(int type, char phase, int streamID, int slot, int size) {
+    unsigned long long pos = this->head.fetch_add(1, memory_order_relaxed);
+    trace_event * e = &this->ring[pos % this->capacity];
+
+    e->seq.store(0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e->ts = monotonic_time();
+    e->type = type;
+    e->phase = phase;
+    e->streamID = streamID;
+    e->slot = slot;
+    e->size = size;
+    e->seq.store(pos + 1, memory_order_release);
+}
+
+//
+// The events in the ring as a Chrome trace
+//
+// Every stream ID is shown as a thread of the current process. Events
+// still being written while we read are left out.
+//
+string trace_ring::json() {
+    unsigned long long end = this->head.load(memory_order_acquire);
+    unsigned long long pos = (end > this->capacity) ? end - this->capacity : 0;
+    ostringstream os;
+    bool first = true;
+
+    os << "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for (; pos < end; pos++) {
+        trace_event * e = &this->ring[pos % this->capacity];
+        if (e->seq.load(memory_order_acquire) != pos + 1) continue;
+
+        unsigned long long ts = e->ts;
+        int type = e->type, phase = e->phase, streamID = e->streamID, slot = e->slot, size = e->size;
+
+        // Overwritten while we copied it
+        atomic_thread_fence(memory_order_acquire);
+        if (e->seq.load(memory_order_relaxed) != pos + 1) continue;
+        if (type >= NUM_TRACE_TYPES) continue;
+
+        os << (first ? "" : ",") << "\n  { \"name\": \"" << TRACE_NAMES[type] << "\", \"cat\": \"floppyIO\", \"ph\": \"" << (char)phase
+           << "\", \"ts\": " << ts << ", \"pid\": " << getpid() << ", \"tid\": " << streamID;
+        if (phase == TP_INSTANT) os << ", \"s\": \"t\"";
+        if ((slot >= 0) || (size >= 0)) {
+            os << ", \"args\": { ";
+            if (slot >= 0) os << "\"slot\": " << slot << ((size >= 0) ? ", " : "");
+            if (size >= 0) os << "\"size\": " << size;
+            os << " }";
+        }
+        os << " }";
+        first = false;
+    }
+    os << "\n] }\n";
+
+    return os.str();
+}
+
+// ===================================================================
+// trace_span
+// ===================================================================
+
+trace_span::trace_span(trace_ring * ring, int type, int streamID) {
+    this->ring = ring;
+    this->type = type;
+    this->streamID = streamID;
+    if (this->ring != NULL) this->ring->event(type, TP_BEGIN, streamID);
+}
+
+trace_span::~trace_span() {
+    if (this->ring != NULL) this->ring->event(this->type, TP_END, this->streamID);
+}
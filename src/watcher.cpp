@@ -0,0 +1,108 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis 
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   watcher.cpp
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// File change notification
+//
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+
+#if defined __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "../includes/watcher.h"
+
+using namespace fpio;
+
+//
+// Start watching the given file
+//
+// Only regular files are watched: writes to a block device
+// go through the device and never show up as file events.
+//
+watcher::watcher(const char * file) {
+    struct stat st;
+
+    this->fd = -1;
+    this->wd = -1;
+    if ((stat(file, &st) != 0) || !S_ISREG(st.st_mode)) return;
+
+#if defined __linux__
+    this->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (this->fd < 0) return;
+
+    this->wd = inotify_add_watch(this->fd, file, IN_MODIFY | IN_CLOSE_WRITE);
+    if (this->wd < 0) {
+        close(this->fd);
+        this->fd = -1;
+    }
+#endif
+}
+
+//
+// Release the watch
+//
+watcher::~watcher() {
+    if (this->fd >= 0) close(this->fd);
+}
+
+//
+// Check if we have change notifications
+//
+bool watcher::active() {
+    return (this->wd >= 0);
+}
+
+//
+// Wait for the file to change or the timeout to expire
+//
+// All pending events are consumed, so that a burst of writes
+// wakes us up only once.
+//
+int watcher::wait(unsigned long long timeoutUs) {
+    struct pollfd pfd;
+    struct timespec ts;
+    char buf[4096];
+
+    // Without a watch, just sleep
+    if (!this->active()) {
+        usleep(timeoutUs);
+        return 0;
+    }
+
+    pfd.fd = this->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    ts.tv_sec = timeoutUs / 1000000;
+    ts.tv_nsec = (timeoutUs % 1000000) * 1000;
+    int lRet = ppoll(&pfd, 1, &ts, NULL);
+    if (lRet <= 0) return 0;
+
+    // Drain the event queue
+    while (read(this->fd, buf, sizeof(buf)) > 0);
+    return 1;
+}
@@ -0,0 +1,283 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   benchmark.cpp
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Loopback benchmark
+//
+// Runs a host and a client endpoint in two processes over a scratch
+// image on tmpfs and on a disk-backed file, and sweeps the message
+// size, the sync policy and the O_EXTENDED/O_SYNCHRONIZED flags.
+// The results are written to stdout as JSON:
+//
+//   { "benchmark": "floppyIO", "results": [ {
+//       "image": "tmpfs", "policy": "SYNC_PER_COMMIT", "extended": true,
+//       "synchronized": true, "size": 4096, "messages": 1000,
+//       "mb_per_s": 123.4, "msg_per_s": 30123.0,
+//       "latency_us": { "samples": 2000, "p50": 12.1, "p99": 40.2 } }, ... ] }
+//
+// Synchronized runs send a stream of messages for the throughput and
+// time round trips (message and equally sized reply) for the latency.
+// Without O_SYNCHRONIZED nothing tells the sender that a message was
+// read, so only the sender is measured and the latency is the time
+// spent in send().
+//
+// A percentile is only reported if at least MIN_TAIL_SAMPLES samples
+// lie above it, e.g. p99 needs 1000 round trips and p999 10000.
+//
+// With -s every result also carries the counters of the host end
+// during the throughput run (see io_stats::json) as "stats".
+//
+// Usage: benchmark [-t tmpfs dir] [-d disk dir] [-n round trips] [-q] [-s]
+//
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "../includes/floppyIO.h"
+
+using namespace std;
+using namespace fpio;
+
+// The data moved in each throughput run
+static const int SZ_THROUGHPUT = 8 * 1024 * 1024;
+
+static const int SIZES[] = { 64, 512, 4096, 65536, 262144 };
+static const int POLICIES[] = { SYNC_PER_OPERATION, SYNC_PER_COMMIT, SYNC_READ_INVALIDATE, SYNC_NONE };
+static const char * POLICY_NAMES[] = { "SYNC_PER_OPERATION", "SYNC_PER_COMMIT", "SYNC_READ_INVALIDATE", "SYNC_NONE" };
+
+// The samples a percentile needs above it to be reported
+static const int MIN_TAIL_SAMPLES = 10;
+
+// How long (ms) either end waits for the other, so that a failed end
+// fails its run instead of hanging the sweep
+static const int BENCH_TIMEOUT = 30000;
+
+struct result {
+    double mbPerSec;
+    double msgPerSec;
+    int messages;
+    int samples;
+    double p50, p99, p999;
+    string stats;
+};
+
+//
+// Current time in microseconds
+//
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+//
+// Whether there are enough samples to tell the given percentile
+//
+static bool percentileValid(size_t samples, double p) {
+    return samples * (1.0 - p) >= MIN_TAIL_SAMPLES;
+}
+
+//
+// The value below which the given fraction of the samples falls
+//
+static double percentile(vector<double> & samples, double p) {
+    if (samples.empty()) return 0;
+    size_t i = (size_t)(p * samples.size());
+    if (i >= samples.size()) i = samples.size() - 1;
+    return samples[i];
+}
+
+//
+// The client end: echo the round trips, then swallow the stream and
+// acknowledge it with one byte
+//
+static int client(const char * file, int flags, int policy, int size, int rounds, int messages) {
+    floppyIO io(file, flags | O_CLIENT | O_NORESET, policy);
+    if (!io.ready()) return 1;
+    io.syncTimeout = BENCH_TIMEOUT;
+    io.waitStrategy = WAIT_ADAPTIVE;
+
+    vector<char> buf(size + 1);
+    for (int i=0; i<rounds; i++) {
+        int lRet = io.receive(buf.data(), size + 1);
+        if (lRet < 0) return 2;
+        if (io.send(buf.data(), size + 1) < 0) return 3;
+    }
+    for (int i=0; i<messages; i++) {
+        if (io.receive(buf.data(), size + 1) < 0) return 4;
+    }
+    if (io.send((char *)"!", 2) < 0) return 5;
+    return 0;
+}
+
+//
+// Run one configuration
+//
+// @return  FALSE if one of the ends failed
+//
+static bool run(const char * file, int flags, int policy, int size, int rounds, result * res) {
+    bool bSync = (flags & O_SYNCHRONIZED) != 0;
+    vector<double> samples;
+    pid_t pid = 0;
+    double t0, t1;
+
+    int messages = SZ_THROUGHPUT / size;
+    if (policy == SYNC_PER_OPERATION) messages /= 10;
+    if (messages < 20) messages = 20;
+    if (messages > 5000) messages = 5000;
+
+    unlink(file);
+    floppyIO io(file, flags | O_CREATE, policy);
+    bool useStats = (flags & O_STATS) != 0;
+    if (!io.ready()) return false;
+    io.syncTimeout = BENCH_TIMEOUT;
+    io.waitStrategy = WAIT_ADAPTIVE;
+
+    // Payload without null bytes, so the classic protocol keeps it whole
+    vector<char> buf(size + 1);
+    for (int i=0; i<size; i++) buf[i] = 'a' + (i * 7) % 26;
+    buf[size] = 0;
+
+    if (bSync) {
+        pid = fork();
+        if (pid == 0) _exit(client(file, flags, policy, size, rounds, messages));
+        if (pid < 0) return false;
+    }
+
+    // Latency: round trips, or single sends without synchronization
+    for (int i=0; i<rounds; i++) {
+        t0 = now();
+        if (io.send(buf.data(), size + 1) < 0) break;
+        if (bSync && (io.receive(buf.data(), size + 1) < 0)) break;
+        samples.push_back(now() - t0);
+    }
+    if (useStats) io.getStats()->clear();
+
+    // Throughput: a stream of messages, until the client says it has them all
+    t0 = now();
+    for (int i=0; (i<messages) && ((int)samples.size() == rounds); i++) {
+        if (io.send(buf.data(), size + 1) < 0) break;
+    }
+    if (bSync && io.ready()) io.receive(buf.data(), size + 1);
+    t1 = now();
+
+    if (bSync) {
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) return false;
+    }
+    if ((int)samples.size() != rounds) return false;
+
+    sort(samples.begin(), samples.end());
+    res->messages = messages;
+    res->samples = samples.size();
+    res->msgPerSec = messages / ((t1 - t0) / 1e6);
+    res->mbPerSec = res->msgPerSec * size / (1024.0 * 1024.0);
+    res->p50 = percentile(samples, 0.50);
+    res->p99 = percentile(samples, 0.99);
+    res->p999 = percentile(samples, 0.999);
+    if (useStats) res->stats = io.getStats()->json();
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    string dirTmpfs = "/dev/shm", dirDisk = "/var/tmp";
+    int rounds = 2000;
+    bool quick = false;
+    int extra = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:d:n:qs")) != -1) {
+        switch (opt) {
+            case 't': dirTmpfs = optarg; break;
+            case 'd': dirDisk = optarg; break;
+            case 'n': rounds = atoi(optarg); break;
+            case 'q': quick = true; break;
+            case 's': extra = O_STATS; break;
+            default:
+                fprintf(stderr, "Usage: %s [-t tmpfs dir] [-d disk dir] [-n round trips] [-q] [-s]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (quick) rounds = 200;
+    if (rounds < 1) rounds = 1;
+
+    const char * images[2][2] = {
+        { "tmpfs", NULL },
+        { "disk",  NULL }
+    };
+    string fileTmpfs = dirTmpfs + "/floppyio-bench.img";
+    string fileDisk = dirDisk + "/floppyio-bench.img";
+    images[0][1] = fileTmpfs.c_str();
+    images[1][1] = fileDisk.c_str();
+
+    printf("{ \"benchmark\": \"floppyIO\", \"results\": [");
+    bool first = true;
+
+    for (int img=0; img<2; img++) {
+        for (int p=0; p<4; p++) {
+            for (int mode=0; mode<4; mode++) {
+                int flags = ((mode & 1) ? O_EXTENDED : 0) | ((mode & 2) ? O_SYNCHRONIZED : 0) | extra;
+                for (unsigned int s=0; s<sizeof(SIZES)/sizeof(SIZES[0]); s++) {
+                    int r = rounds;
+                    result res;
+
+                    // fsync on every operation is slow on a disk, keep it short
+                    if (POLICIES[p] == SYNC_PER_OPERATION) r = (rounds + 9) / 10;
+                    if (quick && (SIZES[s] > 4096)) r = (r + 9) / 10;
+
+                    fprintf(stderr, "%s %s extended=%d synchronized=%d size=%d\n", images[img][0],
+                        POLICY_NAMES[p], (mode & 1), (mode & 2) >> 1, SIZES[s]);
+
+                    bool ok = run(images[img][1], flags, POLICIES[p], SIZES[s], r, &res);
+                    printf("%s\n  { \"image\": \"%s\", \"policy\": \"%s\", \"extended\": %s, \"synchronized\": %s, \"size\": %d, ",
+                        first ? "" : ",", images[img][0], POLICY_NAMES[p],
+                        (mode & 1) ? "true" : "false", (mode & 2) ? "true" : "false", SIZES[s]);
+                    if (ok) {
+                        printf("\"messages\": %d, \"mb_per_s\": %.3f, \"msg_per_s\": %.1f, \"latency_us\": { \"samples\": %d",
+                            res.messages, res.mbPerSec, res.msgPerSec, res.samples);
+                        if (percentileValid(res.samples, 0.50)) printf(", \"p50\": %.2f", res.p50);
+                        if (percentileValid(res.samples, 0.99)) printf(", \"p99\": %.2f", res.p99);
+                        if (percentileValid(res.samples, 0.999)) printf(", \"p999\": %.2f", res.p999);
+                        printf(" }");
+                        if (!res.stats.empty()) printf(", \"stats\": %s", res.stats.c_str());
+                        printf(" }");
+                    } else {
+                        printf("\"error\": true }");
+                    }
+                    fflush(stdout);
+                    first = false;
+                }
+            }
+        }
+        unlink(images[img][1]);
+    }
+
+    printf("\n] }\n");
+    return 0;
+}
@@ -0,0 +1,650 @@
+// This file is part Floppy I/O, a Virtual Machine - Hypervisor intercommunication system.
+// Copyright (C) 2011 Ioannis Charalampidis
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// -------------------------------------------------------------------
+// File:   regression.cpp
+// Author: Ioannis Charalampidis <ioannis.charalampidis AT cern DOT ch>
+// License: GNU Lesser General Public License - Version 3.0
+// -------------------------------------------------------------------
+//
+// Regression tests
+//
+// Every test runs a host and a client endpoint over a scratch image on
+// tmpfs. The host is opened first. Most tests then fork the client,
+// which reports through its exit status. One line per test goes to
+// stdout, and the exit status is the number of failed tests.
+//
+// Usage: regression [-t tmpfs dir]
+//
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <thread>
+
+#include "../includes/floppyIO.h"
+#include "../includes/asyncIO.h"
+#include "../includes/coroutine.h"
+#include "../includes/stripedIO.h"
+
+using namespace std;
+using namespace fpio;
+
+static string scratch = "/dev/shm/floppyio-regression.img";
+
+//
+// Run the client end in its own process
+//
+// @return  The pid of the client, or -1
+//
+template <typename F> static pid_t forkClient(F body) {
+    pid_t pid = fork();
+    if (pid == 0) _exit(body() ? 0 : 1);
+    return pid;
+}
+
+//
+// Wait for the client end
+//
+// @return  TRUE if it reported success
+//
+static bool joinClient(pid_t pid) {
+    int status;
+    if (pid < 0) return false;
+    if (waitpid(pid, &status, 0) < 0) return false;
+    return WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+
+//
+// ==[ Tests ]========================================================
+//
+
+//
+// A streaming send aborted while it waits in reserve() for a ring
+// slot still tells the other end
+//
+static bool testAbortInReserve() {
+    unlink(scratch.c_str());
+    floppyIO host(scratch.c_str(), O_CREATE | O_SYNCHRONIZED | O_EXTENDED, make_layout(2), SYNC_NONE);
+    if (!host.ready()) return false;
+    host.syncTimeout = 2000;
+
+    pid_t pid = forkClient([] {
+        floppyIO client(scratch.c_str(), O_CLIENT | O_NORESET | O_SYNCHRONIZED | O_EXTENDED, make_layout(2), SYNC_NONE);
+        if (!client.ready()) return false;
+        client.syncTimeout = 2000;
+
+        // Let the sender fill the ring and block
+        usleep(500000);
+        ostringstream os;
+        client.receive(&os, 0);
+        return os.bad() && os.eof() && !client.error();
+    });
+
+    // More than the ring holds
+    istringstream is(string(host.layout.szBufferOut * 4, 'x'));
+    thread stopper([&host] { usleep(200000); host.abort(0); });
+    int lRet = host.send(&is, 0);
+    stopper.join();
+
+    return joinClient(pid) && (lRet == ERR_ABORTED);
+}
+
+//
+// O_DELTA still publishes the whole message after the other end
+// reset the image under it
+//
+static bool testDeltaAfterReset() {
+    disk_layout layout = make_layout(1, LO_SUPERBLOCK);
+    string msg(3 * SZ_SECTOR, 'a');
+    char buf[4 * SZ_SECTOR];
+
+    unlink(scratch.c_str());
+    floppyIO * host = new floppyIO(scratch.c_str(), O_CREATE | O_EXTENDED, layout, SYNC_NONE);
+    floppyIO client(scratch.c_str(), O_CLIENT | O_NORESET | O_EXTENDED | O_DELTA, layout, SYNC_NONE);
+    if (!host->ready() || !client.ready()) return false;
+
+    if (client.send((char *)msg.data(), msg.size(), 0) != (int)msg.size()) return false;
+    if ((host->receive(buf, sizeof(buf), 0) != (int)msg.size()) || (msg.compare(0, msg.size(), buf, msg.size()) != 0)) return false;
+
+    // The host opens the image again, which zeroes it
+    delete host;
+    host = new floppyIO(scratch.c_str(), O_EXTENDED, layout, SYNC_NONE);
+    if (!host->ready()) return false;
+
+    bool ok = (client.send((char *)msg.data(), msg.size(), 0) == (int)msg.size()) &&
+              (host->receive(buf, sizeof(buf), 0) == (int)msg.size()) &&
+              (msg.compare(0, msg.size(), buf, msg.size()) == 0);
+    delete host;
+    return ok;
+}
+
+//
+// O_DELTA is refused on layouts without a superblock, where a reset
+// by the other end would leave stale bytes on the image
+//
+static bool testDeltaNeedsSuperblock() {
+    unlink(scratch.c_str());
+    floppyIO classic(scratch.c_str(), O_CREATE | O_EXTENDED | O_DELTA, SYNC_NONE);
+    if (classic.ready() || (classic.errorCode != ERR_INVALID)) return false;
+
+    unlink(scratch.c_str());
+    floppyIO ring(scratch.c_str(), O_CREATE | O_EXTENDED | O_DELTA, make_layout(2), SYNC_NONE);
+    return !ring.ready() && (ring.errorCode == ERR_INVALID);
+}
+
+//
+// A message with a bad checksum can be received again once it is
+// readable, without clearing the receiver first
+//
+static bool testChecksumRetry() {
+    unlink(scratch.c_str());
+    floppyIO host(scratch.c_str(), O_CREATE | O_EXTENDED | O_CHECKSUM, SYNC_NONE);
+    if (!host.ready()) return false;
+    if (host.send((char *)"checksummed", 12, 0) != 12) return false;
+
+    // Flip a payload byte behind its back
+    unsigned int ofs = host.layout.ofsBufferOut + SZ_EXTENDED_HEADER;
+    int fd = open(scratch.c_str(), O_RDWR);
+    if ((fd < 0) || (pwrite(fd, "C", 1, ofs) != 1)) return false;
+
+    pid_t pid = forkClient([fd, ofs] {
+        floppyIO client(scratch.c_str(), O_CLIENT | O_NORESET | O_EXTENDED, SYNC_NONE);
+        char buf[32];
+        if (!client.ready()) return false;
+        if ((client.receive(buf, sizeof(buf), 0) != ERR_CHECKSUM) || !client.ready()) return false;
+
+        // Repaired, it goes through
+        if (pwrite(fd, "c", 1, ofs) != 1) return false;
+        return (client.receive(buf, sizeof(buf), 0) == 12) && (strcmp(buf, "checksummed") == 0);
+    });
+
+    close(fd);
+    return joinClient(pid);
+}
+
+//
+// Stream compressible data with CODEC_LZ over the given layout
+//
+// @return  TRUE if the client got it all back intact
+//
+static bool codecStream(const disk_layout & layout, int szData) {
+    string data;
+    unsigned int x = 1;
+    while ((int)data.size() < szData) {
+        x = x * 1103515245 + 12345;
+        data += "line " + to_string(x >> 20) + " of text\n";
+    }
+
+    unlink(scratch.c_str());
+    floppyIO host(scratch.c_str(), O_CREATE | O_SYNCHRONIZED | O_EXTENDED, layout, SYNC_NONE);
+    if (!host.ready() || (host.setCodec(CODEC_LZ) < 0)) return false;
+
+    pid_t pid = forkClient([&layout, &data] {
+        floppyIO client(scratch.c_str(), O_CLIENT | O_NORESET | O_SYNCHRONIZED | O_EXTENDED, layout, SYNC_NONE);
+        if (!client.ready()) return false;
+        ostringstream os;
+        client.receive(&os, 0);
+        return os.str() == data;
+    });
+
+    istringstream is(data);
+    int lRet = host.send(&is, 0);
+    return joinClient(pid) && (lRet == (int)data.size());
+}
+
+//
+// Buffers larger than SZ_CODEC_MAX_RAW on a large classic image
+//
+static bool testCodecLargeImage() {
+    return codecStream(make_classic_layout(40 * 1024 * 1024), 48 * 1024 * 1024);
+}
+
+//
+// An uneven split can give one direction more than SZ_CODEC_MAX_RAW
+// on a smaller image
+//
+static bool testCodecUnevenSplit() {
+    return codecStream(make_classic_layout(20 * 1024 * 1024, SPLIT_MIN), 40 * 1024 * 1024);
+}
+
+//
+// O_DIRECTIO refuses layouts where both ends write to the same
+// block, and works on aligned ones
+//
+static bool testDirectLayout() {
+    disk_layout layout = make_layout(4, LO_ALIGNED | LO_SUPERBLOCK);
+    char buf[64];
+
+    unlink(scratch.c_str());
+    floppyIO classic(scratch.c_str(), O_CREATE | O_EXTENDED | O_DIRECTIO, SYNC_NONE);
+    if (classic.ready() || (classic.errorCode != ERR_INVALID)) return false;
+
+    unlink(scratch.c_str());
+    floppyIO host(scratch.c_str(), O_CREATE | O_SYNCHRONIZED | O_EXTENDED | O_DIRECTIO, layout, SYNC_NONE);
+    if (!host.ready()) return false;
+    host.syncTimeout = 2000;
+
+    pid_t pid = forkClient([&layout] {
+        floppyIO client(scratch.c_str(), O_CLIENT | O_NORESET | O_SYNCHRONIZED | O_EXTENDED | O_DIRECTIO, layout, SYNC_NONE);
+        char buf[64];
+        if (!client.ready() || (client.caps < 0)) return false;
+        client.syncTimeout = 2000;
+        if (client.receive(buf, sizeof(buf), 0) != 7) return false;
+        return client.send(buf, 7, 0) == 7;
+    });
+
+    bool ok = (host.negotiate(2000) == ERR_NONE) &&
+              (host.send((char *)"direct", 7, 0) == 7) &&
+              (host.receive(buf, sizeof(buf), 0) == 7) &&
+              (strcmp(buf, "direct") == 0);
+    return joinClient(pid) && ok;
+}
+
+//
+// The host settles on what the client offered without calling
+// negotiate, here dropping the extended header
+//
+static bool testLazyCaps() {
+    disk_layout layout = make_layout(2, LO_SUPERBLOCK);
+    char buf[64];
+
+    unlink(scratch.c_str());
+    floppyIO host(scratch.c_str(), O_CREATE | O_SYNCHRONIZED | O_EXTENDED, layout, SYNC_NONE);
+    if (!host.ready() || (host.caps >= 0)) return false;
+    host.syncTimeout = 2000;
+
+    pid_t pid = forkClient([&layout] {
+        floppyIO client(scratch.c_str(), O_CLIENT | O_NORESET | O_SYNCHRONIZED, layout, SYNC_NONE);
+        char buf[64];
+        if (!client.ready()) return false;
+        client.syncTimeout = 2000;
+        if (client.send((char *)"hello", 6, 0) < 0) return false;
+        return (client.receive(buf, sizeof(buf), 0) == 5) && (strcmp(buf, "plain") == 0);
+    });
+
+    bool ok = (host.receive(buf, sizeof(buf), 0) == 5) && (strcmp(buf, "hello") == 0) &&
+              (host.caps >= 0) && !host.useExtended &&
+              (host.send((char *)"plain", 6, 0) >= 0);
+    return joinClient(pid) && ok;
+}
+
+//
+// O_AUTOSIZE keeps the split of the layout it rebuilds for a bigger
+// image
+//
+static bool testAutosizeSplit() {
+    const unsigned int szImage = 4 * 1024 * 1024;
+    disk_layout given[] = { make_classic_layout(SZ_FLOPPY, SPLIT_MIN), make_layout(4, LO_ALIGNED, SZ_FLOPPY, 80) };
+    disk_layout want[] = { make_classic_layout(szImage, SPLIT_MIN), make_layout(4, LO_ALIGNED, szImage, 80) };
+
+    for (int i=0; i<2; i++) {
+        unlink(scratch.c_str());
+        int fd = open(scratch.c_str(), O_CREAT | O_RDWR, 0600);
+        if ((fd < 0) || (ftruncate(fd, szImage) != 0)) return false;
+        close(fd);
+
+        floppyIO host(scratch.c_str(), O_AUTOSIZE, given[i], SYNC_NONE);
+        if (!host.ready() || (host.layout.szImage != szImage)) return false;
+        if ((host.layout.ofsControlOut != want[i].ofsControlOut) || (host.layout.ofsBufferOut != want[i].ofsBufferOut)) return false;
+        if ((host.layout.szBufferIn != want[i].szBufferIn) || (host.layout.szBufferOut != want[i].szBufferOut)) return false;
+    }
+    return true;
+}
+
+//
+// A payload written in place on a mapped image is flushed before its
+// control byte is published
+//
+static bool testMappedCommitFlush() {
+    const int extra[] = { O_EXTENDED, 0 };
+    for (int i=0; i<2; i++) {
+        unlink(scratch.c_str());
+        floppyIO host(scratch.c_str(), O_CREATE | O_MMAP | O_STATS | extra[i], make_layout(2), SYNC_PER_COMMIT);
+        if (!host.ready()) return false;
+
+        char * ptr = host.reserve(4096, 0);
+        if (ptr == NULL) return false;
+        memset(ptr, 'm', 4096);
+        host.getStats()->clear();
+        if (host.commit(4096, 0) != 4096) return false;
+
+        unsigned long long szHeader = (extra[i] & O_EXTENDED) ? SZ_EXTENDED_HEADER : 0;
+        if (host.getStats()->bytesFlushed < 4096 + szHeader) return false;
+    }
+    return true;
+}
+
+//
+// An async round trip, then a send cancelled while it waits for a
+// ring slot, which the other end sees as an aborted stream
+//
+static bool testAsyncCancel() {
+    unlink(scratch.c_str());
+    asyncIO host(scratch.c_str(), O_CREATE | O_SYNCHRONIZED | O_EXTENDED, make_layout(2), SYNC_NONE);
+    if (!host.ready()) return false;
+
+    pid_t pid = forkClient([] {
+        floppyIO client(scratch.c_str(), O_CLIENT | O_NORESET | O_SYNCHRONIZED | O_EXTENDED, make_layout(2), SYNC_NONE);
+        char buf[16];
+        if (!client.ready()) return false;
+        client.syncTimeout = 2000;
+        if ((client.receive(buf, sizeof(buf), 0) != 5) || (strcmp(buf, "ping") != 0)) return false;
+        if (client.send((char *)"pong", 5, 0) != 5) return false;
+
+        // Let the third send block, and be cancelled
+        usleep(500000);
+        if ((client.receive(buf, sizeof(buf), 0) != 2) || (strcmp(buf, "a") != 0)) return false;
+        if ((client.receive(buf, sizeof(buf), 0) != 2) || (strcmp(buf, "b") != 0)) return false;
+        return client.receive(buf, sizeof(buf), 0) == ERR_ABORTED;
+    });
+
+    char buf[16];
+    future<int> ping = host.send_async("ping", 5);
+    future<int> pong = host.receive_async(buf, sizeof(buf));
+    bool ok = (ping.get() == 5) && (pong.get() == 5) && (strcmp(buf, "pong") == 0);
+
+    // Two fill the ring, the third waits
+    future<int> a = host.send_async("a", 2);
+    future<int> b = host.send_async("b", 2);
+    future<int> c = host.send_async("c", 2);
+    usleep(200000);
+    ok = ok && (host.cancel(0) == 1);
+    ok = ok && (a.get() == 2) && (b.get() == 2) && (c.get() == ERR_ABORTED);
+    return joinClient(pid) && ok;
+}
+
+//
+// Operations queued on one stream complete in the order they were
+// issued, even when a later one could go ahead of an earlier one
+//
+static task sendOne(executor & ex, const char * msg) {
+    co_return co_await ex.send((char *)msg, strlen(msg) + 1, 0);
+}
+
+static task receiveOne(executor & ex, char * buf) {
+    co_return co_await ex.receive(buf, 16, 0);
+}
+
+static bool testCoroutineOrder() {
+    unlink(scratch.c_str());
+    floppyIO host(scratch.c_str(), O_CREATE | O_SYNCHRONIZED | O_EXTENDED, make_layout(2), SYNC_NONE);
+    if (!host.ready()) return false;
+    host.syncTimeout = 2000;
+
+    pid_t pid = forkClient([] {
+        floppyIO client(scratch.c_str(), O_CLIENT | O_NORESET | O_SYNCHRONIZED | O_EXTENDED, make_layout(2), SYNC_NONE);
+        char buf[16];
+        if (!client.ready()) return false;
+        client.syncTimeout = 2000;
+
+        // Only once the first send and receive are waiting
+        usleep(300000);
+        if (client.send((char *)"first", 6, 0) != 6) return false;
+        if (client.send((char *)"second", 7, 0) != 7) return false;
+        const char * want[] = { "x", "y", "one", "two" };
+        for (const char * w : want)
+            if ((client.receive(buf, sizeof(buf), 0) <= 0) || (strcmp(buf, w) != 0)) return false;
+        return true;
+    });
+
+    // Fill the ring, so the first send has to wait
+    if ((host.send((char *)"x", 2, 0) != 2) || (host.send((char *)"y", 2, 0) != 2)) return false;
+
+    char r1[16] = "", r2[16] = "";
+    executor ex(&host);
+    ex.spawn(sendOne(ex, "one"));
+    ex.spawn(receiveOne(ex, r1));
+    if (ex.run(100) != ERR_TIMEOUT) return false;
+
+    // By now both could complete right away, but must queue up behind
+    usleep(600000);
+    ex.spawn(sendOne(ex, "two"));
+    ex.spawn(receiveOne(ex, r2));
+    bool ok = (ex.run(2000) == ERR_NONE);
+    return joinClient(pid) && ok && (strcmp(r1, "first") == 0) && (strcmp(r2, "second") == 0);
+}
+
+//
+// A gathered message longer than the buffer is cut at the buffer
+// limit, and scatters into pieces split elsewhere. An abort reaches
+// a scattered receive too.
+//
+static bool testScatterGather() {
+    unlink(scratch.c_str());
+    floppyIO host(scratch.c_str(), O_CREATE | O_SYNCHRONIZED | O_EXTENDED, make_layout(2), SYNC_NONE);
+    if (!host.ready()) return false;
+    host.syncTimeout = 2000;
+
+    // The limit falls in the middle of the third piece
+    int szMax = host.layout.szBufferOut - SZ_EXTENDED_HEADER;
+    string data(szMax + 300, 0);
+    for (size_t i=0; i<data.size(); i++) data[i] = (char)(i * 13 + i / 509);
+
+    pid_t pid = forkClient([&data, szMax] {
+        floppyIO client(scratch.c_str(), O_CLIENT | O_NORESET | O_SYNCHRONIZED | O_EXTENDED, make_layout(2), SYNC_NONE);
+        if (!client.ready()) return false;
+        client.syncTimeout = 2000;
+
+        string got(szMax + 1000, 0);
+        struct iovec iov[2] = { { &got[0], 1000 }, { &got[1000], (size_t)szMax } };
+        if (client.receive(iov, 2, 0) != szMax) return false;
+        if (got.compare(0, szMax, data, 0, szMax) != 0) return false;
+
+        // An abort marker is not an empty message
+        return client.receive(iov, 2, 0) == ERR_ABORTED;
+    });
+
+    struct iovec iov[3] = {
+        { &data[0], 100 },
+        { &data[100], (size_t)szMax - 300 },
+        { &data[szMax - 200], 500 },
+    };
+    int lRet = host.send(iov, 3, 0);
+    bool ok = (lRet == szMax) && (host.sendAbort(0) == ERR_NONE);
+    return joinClient(pid) && ok;
+}
+
+//
+// A payload of many chunks, striped over two images, arrives intact
+//
+static bool testStripedRoundTrip() {
+    vector<string> files = { scratch, scratch + ".1" };
+    unlink(files[0].c_str());
+    unlink(files[1].c_str());
+    stripedIO host(files, O_CREATE, make_layout(2), SYNC_NONE);
+    if (!host.ready()) return false;
+
+    // Several rounds over every stripe's chunks, and a partial one
+    string data(20 * host.stripe(0)->layout.szBufferOut + 123, 0);
+    for (size_t i=0; i<data.size(); i++) data[i] = (char)(i * 7 + i / 251);
+
+    pid_t pid = forkClient([&files, &data] {
+        stripedIO client(files, O_CLIENT | O_NORESET, make_layout(2), SYNC_NONE);
+        if (!client.ready()) return false;
+        ostringstream os;
+        return (client.receive(&os, 0) == (int)data.size()) && (os.str() == data);
+    });
+
+    istringstream is(data);
+    int lRet = host.send(&is, 0);
+    bool ok = joinClient(pid) && (lRet == (int)data.size());
+    unlink(files[1].c_str());
+    return ok;
+}
+
+//
+// Aborting one stripe in the middle of a transfer fails it on both
+// ends, and the receiving threads of all the stripes stop
+//
+static bool testStripedAbort() {
+    vector<string> files = { scratch, scratch + ".1" };
+    unlink(files[0].c_str());
+    unlink(files[1].c_str());
+    stripedIO host(files, O_CREATE, make_layout(2), SYNC_NONE);
+    if (!host.ready()) return false;
+    host.stripe(0)->syncTimeout = host.stripe(1)->syncTimeout = 2000;
+
+    pid_t pid = forkClient([&files] {
+        stripedIO client(files, O_CLIENT | O_NORESET, make_layout(2), SYNC_NONE);
+        if (!client.ready()) return false;
+        client.stripe(0)->syncTimeout = client.stripe(1)->syncTimeout = 2000;
+
+        // Let the sender fill the rings and block
+        usleep(500000);
+        ostringstream os;
+        int lRet = client.receive(&os, 0);
+        return (lRet == ERR_ABORTED) && os.bad();
+    });
+
+    // More than the rings hold
+    istringstream is(string(host.stripe(0)->layout.szBufferOut * 16, 'x'));
+    thread stopper([&host] { usleep(200000); host.stripe(0)->abort(0); });
+    int lRet = host.send(&is, 0);
+    stopper.join();
+
+    bool ok = joinClient(pid) && (lRet == ERR_ABORTED);
+    unlink(files[1].c_str());
+    return ok;
+}
+
+//
+// Rebalancing without traffic keeps the split of an aligned layout,
+// whose data starts a whole block into the image
+//
+static bool testRebalanceKeepsSplit() {
+    disk_layout layout = make_layout(2, LO_ALIGNED | LO_SUPERBLOCK, SZ_FLOPPY, 30);
+    unlink(scratch.c_str());
+    floppyIO host(scratch.c_str(), O_CREATE | O_SYNCHRONIZED | O_EXTENDED, layout, SYNC_NONE);
+    if (!host.ready()) return false;
+    host.syncTimeout = 2000;
+
+    pid_t pid = forkClient([&layout] {
+        floppyIO client(scratch.c_str(), O_CLIENT | O_NORESET | O_SYNCHRONIZED | O_EXTENDED, layout, SYNC_NONE);
+        char buf[16];
+        if (!client.ready()) return false;
+        client.syncTimeout = 2000;
+        if (client.receive(buf, sizeof(buf), 0) != 5) return false;
+        if (client.send((char *)"pong", 5, 0) != 5) return false;
+        unsigned int ofsControlOut = client.layout.ofsControlOut;
+        if (client.rebalance(2000) != ERR_NONE) return false;
+        return (client.rebalance(2000) == ERR_NONE) && (client.layout.ofsControlOut == ofsControlOut);
+    });
+
+    // The round trip counts as traffic, the second rebalance has none
+    char buf[16];
+    bool ok = (host.send((char *)"ping", 5, 0) == 5) && (host.receive(buf, sizeof(buf), 0) == 5);
+    ok = ok && (host.rebalance(2000, 30) == ERR_NONE);
+    ok = ok && (host.rebalance(2000) == ERR_NONE);
+    ok = ok && (host.layout.ofsControlOut == layout.ofsControlOut);
+    return joinClient(pid) && ok;
+}
+
+//
+// On a multiplexed layout a stream whose slots are all full does not
+// hold up another stream, in either direction
+//
+static bool testMultiplexNoStall() {
+    disk_layout layout = make_layout(2, LO_MULTIPLEX);
+    unlink(scratch.c_str());
+    floppyIO host(scratch.c_str(), O_CREATE | O_SYNCHRONIZED | O_EXTENDED, layout, SYNC_NONE);
+    if (!host.ready()) return false;
+    host.syncTimeout = 2000;
+
+    pid_t pid = forkClient([&layout] {
+        floppyIO client(scratch.c_str(), O_CLIENT | O_NORESET | O_SYNCHRONIZED | O_EXTENDED, layout, SYNC_NONE);
+        char buf[16];
+        if (!client.ready()) return false;
+        client.syncTimeout = 2000;
+
+        // Stream 1 stays unread until stream 2 made a round trip
+        if ((client.receive(buf, sizeof(buf), 2) != 5) || (strcmp(buf, "ping") != 0)) return false;
+        if (client.send((char *)"pong", 5, 2) != 5) return false;
+        if ((client.receive(buf, sizeof(buf), 1) != 2) || (strcmp(buf, "a") != 0)) return false;
+        return (client.receive(buf, sizeof(buf), 1) == 2) && (strcmp(buf, "b") == 0);
+    });
+
+    // Fill the slots of stream 1
+    char buf[16];
+    bool ok = (host.send((char *)"a", 2, 1) == 2) && (host.send((char *)"b", 2, 1) == 2);
+    ok = ok && (host.poll_send((char *)"c", 2, 1) == ERR_AGAIN);
+
+    // Stream 2 goes ahead, well within the timeout
+    host.syncTimeout = 500;
+    ok = ok && (host.send((char *)"ping", 5, 2) == 5);
+    ok = ok && (host.receive(buf, sizeof(buf), 2) == 5) && (strcmp(buf, "pong") == 0);
+    return joinClient(pid) && ok;
+}
+
+//
+// ==[ Driver ]=======================================================
+//
+
+struct test_case {
+    const char *    name;
+    bool            (*run)();
+};
+
+static const test_case TESTS[] = {
+    { "abort_in_reserve",       testAbortInReserve },
+    { "delta_after_reset",      testDeltaAfterReset },
+    { "delta_needs_superblock", testDeltaNeedsSuperblock },
+    { "checksum_retry",         testChecksumRetry },
+    { "codec_large_image",      testCodecLargeImage },
+    { "codec_uneven_split",     testCodecUnevenSplit },
+    { "direct_layout",          testDirectLayout },
+    { "lazy_caps",              testLazyCaps },
+    { "autosize_split",         testAutosizeSplit },
+    { "mapped_commit_flush",    testMappedCommitFlush },
+    { "async_cancel",           testAsyncCancel },
+    { "coroutine_order",        testCoroutineOrder },
+    { "scatter_gather",         testScatterGather },
+    { "striped_round_trip",     testStripedRoundTrip },
+    { "striped_abort",          testStripedAbort },
+    { "rebalance_keeps_split",  testRebalanceKeepsSplit },
+    { "multiplex_no_stall",     testMultiplexNoStall },
+};
+
+int main(int argc, char ** argv) {
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+            case 't': scratch = string(optarg) + "/floppyio-regression.img"; break;
+            default:
+                fprintf(stderr, "Usage: %s [-t tmpfs dir]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    for (unsigned int i=0; i<sizeof(TESTS)/sizeof(TESTS[0]); i++) {
+        bool ok = TESTS[i].run();
+        printf("%s %s\n", ok ? "PASS" : "FAIL", TESTS[i].name);
+        fflush(stdout);
+        if (!ok) failed++;
+    }
+
+    unlink(scratch.c_str());
+    return failed;
+}